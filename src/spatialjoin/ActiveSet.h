@@ -0,0 +1,167 @@
+// Copyright 2023, University of Freiburg
+// Authors: Patrick Brosi <brosi@cs.uni-freiburg.de>.
+
+#ifndef SPATIALJOINS_ACTIVESET_H_
+#define SPATIALJOINS_ACTIVESET_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace sj {
+
+// the smallest y-grid has cells of 2^ACTIVE_SET_BASE_BITS units, each
+// further level is coarser by a factor of 2^ACTIVE_SET_LEVEL_BITS
+const static size_t ACTIVE_SET_BASE_BITS = 12;
+const static size_t ACTIVE_SET_LEVEL_BITS = 3;
+const static size_t ACTIVE_SET_LEVELS = 4;
+
+// an interval is put into the finest level on which it spans at most this
+// many cells, intervals too tall for all levels go into a separate list
+const static int64_t ACTIVE_SET_MAX_CELLS = 4;
+
+// number of intervals compared at once during an overlap scan
+const static size_t ACTIVE_SET_SCAN_CHUNK = 64;
+
+// Set of the y-intervals currently active in the sweep. Intervals are stored
+// in a hierarchy of y-grids, in the cell of their lower bound on the finest
+// level where they span at most ACTIVE_SET_MAX_CELLS cells. Each cell holds
+// the interval bounds as plain arrays, separate from the values, so the
+// overlap scan only touches densely packed integers.
+template <typename V>
+class ActiveSet {
+ public:
+  ActiveSet() : _levels(ACTIVE_SET_LEVELS) {}
+
+  void insert(int32_t lo, int32_t up, const V& v) {
+    Cell& c = cellFor(lo, up);
+    c.lo.push_back(lo);
+    c.up.push_back(up);
+    c.vals.push_back(v);
+    _size++;
+  }
+
+  // erase the interval [lo, up] with a value equal to v
+  void erase(int32_t lo, int32_t up, const V& v) {
+    size_t l = level(lo, up);
+    Cell* c = &_tall;
+    if (l < ACTIVE_SET_LEVELS) {
+      auto it = _levels[l].cells.find(cellId(lo, l));
+      if (it == _levels[l].cells.end()) return;
+      c = &it->second;
+    }
+
+    for (size_t i = 0; i < c->lo.size(); i++) {
+      if (c->lo[i] != lo || c->up[i] != up || !(c->vals[i] == v)) continue;
+
+      // order inside a cell doesn't matter
+      c->lo[i] = c->lo.back();
+      c->up[i] = c->up.back();
+      c->vals[i] = c->vals.back();
+      c->lo.pop_back();
+      c->up.pop_back();
+      c->vals.pop_back();
+      _size--;
+
+      if (l < ACTIVE_SET_LEVELS) {
+        _levels[l].size--;
+        if (c->lo.empty()) _levels[l].cells.erase(cellId(lo, l));
+      }
+      return;
+    }
+  }
+
+  // call f(v) for every interval overlapping [lo, up]
+  template <typename F>
+  void overlaps(int32_t lo, int32_t up, F f) const {
+    for (size_t l = 0; l < ACTIVE_SET_LEVELS; l++) {
+      const Level& lvl = _levels[l];
+      if (lvl.size == 0) continue;
+
+      // intervals overlapping [lo, up] start at most maxHeight(l) below lo
+      int64_t from = (static_cast<int64_t>(lo) - maxHeight(l)) >> bits(l);
+      int64_t to = static_cast<int64_t>(up) >> bits(l);
+
+      if (static_cast<size_t>(to - from + 1) > lvl.cells.size()) {
+        for (const auto& c : lvl.cells) {
+          if (c.first >= from && c.first <= to) scan(c.second, lo, up, f);
+        }
+      } else {
+        for (int64_t id = from; id <= to; id++) {
+          auto it = lvl.cells.find(id);
+          if (it != lvl.cells.end()) scan(it->second, lo, up, f);
+        }
+      }
+    }
+
+    scan(_tall, lo, up, f);
+  }
+
+  size_t size() const { return _size; }
+
+ private:
+  struct Cell {
+    std::vector<int32_t> lo;
+    std::vector<int32_t> up;
+    std::vector<V> vals;
+  };
+
+  struct Level {
+    std::unordered_map<int64_t, Cell> cells;
+    size_t size = 0;
+  };
+
+  static size_t bits(size_t l) {
+    return ACTIVE_SET_BASE_BITS + l * ACTIVE_SET_LEVEL_BITS;
+  }
+
+  static int64_t maxHeight(size_t l) { return ACTIVE_SET_MAX_CELLS << bits(l); }
+
+  static int64_t cellId(int32_t lo, size_t l) {
+    return static_cast<int64_t>(lo) >> bits(l);
+  }
+
+  static size_t level(int32_t lo, int32_t up) {
+    int64_t h = static_cast<int64_t>(up) - lo;
+    size_t l = 0;
+    while (l < ACTIVE_SET_LEVELS && h > maxHeight(l)) l++;
+    return l;
+  }
+
+  Cell& cellFor(int32_t lo, int32_t up) {
+    size_t l = level(lo, up);
+    if (l == ACTIVE_SET_LEVELS) return _tall;
+    _levels[l].size++;
+    return _levels[l].cells[cellId(lo, l)];
+  }
+
+  template <typename F>
+  static void scan(const Cell& c, int32_t lo, int32_t up, F& f) {
+    const int32_t* los = c.lo.data();
+    const int32_t* ups = c.up.data();
+    size_t n = c.lo.size();
+
+    // branch-free compaction of the hits of each chunk, which lets the
+    // compiler vectorize the comparisons
+    uint32_t hits[ACTIVE_SET_SCAN_CHUNK];
+
+    for (size_t base = 0; base < n; base += ACTIVE_SET_SCAN_CHUNK) {
+      size_t m = std::min(ACTIVE_SET_SCAN_CHUNK, n - base);
+      size_t k = 0;
+      for (size_t j = 0; j < m; j++) {
+        hits[k] = j;
+        k += (los[base + j] <= up) & (ups[base + j] >= lo);
+      }
+      for (size_t j = 0; j < k; j++) f(c.vals[base + hits[j]]);
+    }
+  }
+
+  std::vector<Level> _levels;
+  Cell _tall;
+  size_t _size = 0;
+};
+}  // namespace sj
+
+#endif
@@ -0,0 +1,218 @@
+// Copyright 2023, University of Freiburg
+// Authors: Patrick Brosi <brosi@cs.uni-freiburg.de>.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "EventReader.h"
+#include "util/Misc.h"
+
+using sj::EventReader;
+using util::preadAll;
+using util::pwriteAll;
+
+// _____________________________________________________________________________
+EventReader::EventReader(int file, size_t blockSize, bool writable,
+                         size_t from, size_t to)
+    : _file(file),
+      _blockSize(blockSize),
+      _writable(writable),
+      _pos(from),
+      _end(to),
+      _readPos(from),
+      _touched(from) {
+  struct stat st;
+  if (fstat(_file, &st) == 0 && st.st_size > 0) {
+    _mapSize = st.st_size;
+    void* map = mmap(0, _mapSize, PROT_READ | (_writable ? PROT_WRITE : 0),
+                     MAP_SHARED, _file, 0);
+    if (map != MAP_FAILED) {
+      _map = reinterpret_cast<unsigned char*>(map);
+      madvise(_map, _mapSize, MADV_SEQUENTIAL);
+      advise(_pos, _blockSize * EVENT_READ_AHEAD_BLOCKS, MADV_WILLNEED);
+      _prefetchThr = std::thread(&EventReader::prefetch, this);
+      return;
+    }
+  }
+
+  // fall back to reading into a ring of buffers
+  _map = 0;
+  _blocks.resize(EVENT_READ_AHEAD_BLOCKS + 1);
+  for (auto& b : _blocks) b = {new unsigned char[_blockSize], 0, 0};
+  _prefetchThr = std::thread(&EventReader::prefetch, this);
+}
+
+// _____________________________________________________________________________
+EventReader::~EventReader() {
+  {
+    std::unique_lock<std::mutex> lock(_mtx);
+    _stop = true;
+  }
+  _cv.notify_all();
+  if (_prefetchThr.joinable()) _prefetchThr.join();
+
+  if (_map) munmap(_map, _mapSize);
+  for (auto& b : _blocks) delete[] b.buf;
+}
+
+// _____________________________________________________________________________
+ssize_t EventReader::next(unsigned char** buf) {
+  if (!_map) {
+    std::unique_lock<std::mutex> lock(_mtx);
+    _cv.wait(lock, [&]() { return _ready > 0 || _eof; });
+
+    if (_ready == 0) {
+      _lastLen = 0;
+      return 0;
+    }
+
+    const Block& b = _blocks[_first];
+    _first = (_first + 1) % _blocks.size();
+    _ready--;
+
+    _lastPos = b.pos;
+    _lastLen = b.len;
+    *buf = b.buf;
+
+    lock.unlock();
+    _cv.notify_all();
+    return _lastLen;
+  }
+
+  _lastPos = _pos;
+
+  size_t end = std::min(_mapSize, _end);
+
+  if (_pos >= end) {
+    _lastLen = 0;
+    return 0;
+  }
+
+  _lastLen = std::min(_blockSize, end - _pos);
+  *buf = _map + _pos;
+
+  {
+    std::unique_lock<std::mutex> lock(_mtx);
+    _pos += _lastLen;
+  }
+  _cv.notify_all();
+
+  // ask the kernel for the window ahead of us
+  advise(_pos + _blockSize * (EVENT_READ_AHEAD_BLOCKS - 1), _blockSize,
+         MADV_WILLNEED);
+
+  // pages of read-only mappings we have already passed are unmapped from our
+  // own mapping. They stay in the page cache, other readers of the events
+  // file (concurrent stripes, the deduplication) may still need them
+  if (!_writable && _lastPos >= _blockSize)
+    advise(_lastPos - _blockSize, _blockSize, MADV_DONTNEED);
+
+  return _lastLen;
+}
+
+// _____________________________________________________________________________
+ssize_t EventReader::writeBack() {
+  // changes to a shared mapping go directly to the file
+  if (_map || _lastLen <= 0) return _lastLen;
+
+  // the block last handed out directly precedes the first ready one
+  const Block& b = _blocks[(_first + _blocks.size() - 1) % _blocks.size()];
+  return pwriteAll(_file, b.buf, _lastLen, _lastPos);
+}
+
+// _____________________________________________________________________________
+void EventReader::prefetch() {
+  if (_map) {
+    prefetchMapped();
+  } else {
+    prefetchBuffered();
+  }
+}
+
+// _____________________________________________________________________________
+void EventReader::prefetchMapped() {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t end = std::min(_mapSize, _end);
+  size_t window = _blockSize * EVENT_READ_AHEAD_BLOCKS;
+
+  while (true) {
+    size_t from, to;
+    {
+      std::unique_lock<std::mutex> lock(_mtx);
+      _cv.wait(lock, [&]() {
+        return _stop || _touched < std::min(end, _pos + window);
+      });
+      if (_stop) return;
+      from = _touched;
+      to = std::min(end, _pos + window);
+    }
+
+    // fault in one byte per page, this blocks this thread instead of the
+    // consumer on the page cache misses
+    unsigned char sum = 0;
+    for (size_t p = from - (from % page); p < to; p += page) {
+      sum ^= *static_cast<volatile unsigned char*>(_map + p);
+    }
+    (void)sum;
+
+    std::unique_lock<std::mutex> lock(_mtx);
+    _touched = to;
+    if (_touched >= end) return;
+  }
+}
+
+// _____________________________________________________________________________
+void EventReader::prefetchBuffered() {
+  while (true) {
+    Block* b;
+    size_t pos;
+    {
+      std::unique_lock<std::mutex> lock(_mtx);
+
+      // the block last handed out must not be overwritten
+      _cv.wait(lock, [&]() {
+        return _stop || _ready < EVENT_READ_AHEAD_BLOCKS;
+      });
+      if (_stop) return;
+      b = &_blocks[(_first + _ready) % _blocks.size()];
+      pos = _readPos;
+    }
+
+    ssize_t len = 0;
+    if (pos < _end) {
+      len = preadAll(_file, b->buf, std::min(_blockSize, _end - pos), pos);
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(_mtx);
+      if (len != 0) {
+        // errors are handed out like a block
+        b->pos = pos;
+        b->len = len;
+        _ready++;
+        if (len > 0) _readPos += len;
+      }
+      if (len <= 0) _eof = true;
+    }
+    _cv.notify_all();
+
+    if (len <= 0) return;
+  }
+}
+
+// _____________________________________________________________________________
+void EventReader::advise(size_t from, size_t len, int advice) const {
+  if (!_map || from >= _mapSize) return;
+
+  // madvise() requires page-aligned addresses
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = from - (from % page);
+  size_t end = std::min(from + len, _mapSize);
+
+  if (end <= start) return;
+
+  madvise(_map + start, end - start, advice);
+}
@@ -0,0 +1,92 @@
+// Copyright 2023, University of Freiburg
+// Authors: Patrick Brosi <brosi@cs.uni-freiburg.de>.
+
+#ifndef SPATIALJOINS_EVENTREADER_H_
+#define SPATIALJOINS_EVENTREADER_H_
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sj {
+
+// number of blocks ahead of the current read position which are kept in
+// flight by the background prefetcher
+const static size_t EVENT_READ_AHEAD_BLOCKS = 4;
+
+// Block-wise sequential reader for the sorted events file. If possible, the
+// file is memory mapped and blocks are handed out as pointers into the
+// mapping, without copying. If mmap is not available, we fall back to
+// pread'ing each block into an internal buffer. Optionally, only the byte
+// range [from, to) of the file is read.
+//
+// In both cases, a background thread works ahead of the consumer, so the
+// latency of the cache volume is not added to the time spent on each block:
+// mapped pages are faulted in ahead of time, and in the pread fallback the
+// next blocks are read into a ring of buffers.
+class EventReader {
+ public:
+  EventReader(int file, size_t blockSize, bool writable)
+      : EventReader(file, blockSize, writable, 0,
+                    std::numeric_limits<size_t>::max()) {}
+  EventReader(int file, size_t blockSize, bool writable, size_t from,
+              size_t to);
+  ~EventReader();
+
+  // set *buf to the next block and return its size in bytes, 0 if the end of
+  // the file has been reached, or -1 on error
+  ssize_t next(unsigned char** buf);
+
+  // make modifications to the block last returned by next() persistent
+  ssize_t writeBack();
+
+  bool isMapped() const { return _map != 0; }
+
+ private:
+  struct Block {
+    unsigned char* buf;
+    size_t pos;
+    ssize_t len;
+  };
+
+  void advise(size_t from, size_t len, int advice) const;
+  void prefetch();
+  void prefetchMapped();
+  void prefetchBuffered();
+
+  int _file;
+  size_t _blockSize;
+  bool _writable;
+
+  unsigned char* _map = 0;
+  size_t _mapSize = 0;
+
+  size_t _pos = 0;
+  size_t _end = 0;
+  size_t _lastPos = 0;
+  ssize_t _lastLen = 0;
+
+  // pread fallback: ring of EVENT_READ_AHEAD_BLOCKS + 1 blocks, the one last
+  // handed out and up to EVENT_READ_AHEAD_BLOCKS blocks read ahead
+  std::vector<Block> _blocks;
+  size_t _first = 0;
+  size_t _ready = 0;
+  size_t _readPos = 0;
+  bool _eof = false;
+
+  // mmap: end of the range which has already been faulted in
+  size_t _touched = 0;
+
+  bool _stop = false;
+  std::mutex _mtx;
+  std::condition_variable _cv;
+  std::thread _prefetchThr;
+};
+}  // namespace sj
+
+#endif
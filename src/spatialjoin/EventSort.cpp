@@ -0,0 +1,391 @@
+// Copyright 2023, University of Freiburg
+// Authors: Patrick Brosi <brosi@cs.uni-freiburg.de>.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "EventSort.h"
+#include "util/Misc.h"
+
+using util::preadAll;
+using util::pwriteAll;
+
+namespace {
+
+// minimum number of events per thread in the radix sort
+const static size_t RADIX_MIN_CHUNK_SIZE = 1024 * 64;
+
+// _____________________________________________________________________________
+inline uint64_t keyOf(const unsigned char* ev) {
+  uint64_t key;
+  memcpy(&key, ev, sizeof(uint64_t));
+  return key;
+}
+
+// _____________________________________________________________________________
+template <size_t N>
+unsigned char* radixSort(unsigned char* src, unsigned char* dst, size_t n,
+                         size_t eventSize, size_t numThreads) {
+  // if N is given, the event size is known at compile time, which allows the
+  // compiler to inline the copying
+  const size_t size = N ? N : eventSize;
+
+  size_t numChunks = std::max<size_t>(
+      1, std::min(numThreads, n / RADIX_MIN_CHUNK_SIZE + 1));
+
+  std::vector<size_t> bounds(numChunks + 1);
+  for (size_t i = 0; i <= numChunks; i++) bounds[i] = (n * i) / numChunks;
+
+  std::vector<std::array<size_t, 256>> hists(numChunks);
+  std::vector<std::thread> thrds(numChunks);
+
+  for (size_t shift = 0; shift < 64; shift += 8) {
+    for (size_t t = 0; t < numChunks; t++) {
+      thrds[t] = std::thread([&, t]() {
+        auto& hist = hists[t];
+        hist.fill(0);
+        for (size_t i = bounds[t]; i < bounds[t + 1]; i++) {
+          hist[(keyOf(src + i * size) >> shift) & 0xFF]++;
+        }
+      });
+    }
+
+    for (auto& thr : thrds) thr.join();
+
+    // turn the histograms into write offsets, and skip this digit if all
+    // events share it
+    bool skip = false;
+    size_t off = 0;
+    for (size_t b = 0; b < 256; b++) {
+      size_t cnt = 0;
+      for (size_t t = 0; t < numChunks; t++) {
+        size_t c = hists[t][b];
+        hists[t][b] = off;
+        off += c;
+        cnt += c;
+      }
+      if (cnt == n) skip = true;
+    }
+
+    if (skip) continue;
+
+    for (size_t t = 0; t < numChunks; t++) {
+      thrds[t] = std::thread([&, t]() {
+        auto& offs = hists[t];
+        for (size_t i = bounds[t]; i < bounds[t + 1]; i++) {
+          const unsigned char* ev = src + i * size;
+          memcpy(dst + (offs[(keyOf(ev) >> shift) & 0xFF]++) * size, ev, size);
+        }
+      });
+    }
+
+    for (auto& thr : thrds) thr.join();
+
+    std::swap(src, dst);
+  }
+
+  return src;
+}
+
+// a sorted run during the k-way merge
+struct Run {
+  size_t pos, end;
+  unsigned char* buf;
+  size_t bufPos, bufLen;
+};
+
+// _____________________________________________________________________________
+ssize_t fillRun(int file, Run* run, size_t eventSize, size_t bufEvents) {
+  size_t n = std::min(bufEvents, run->end - run->pos);
+  run->bufPos = 0;
+  run->bufLen = n;
+  if (n == 0) return 0;
+
+  ssize_t r = preadAll(file, run->buf, n * eventSize, run->pos * eventSize);
+  if (r < 0 || static_cast<size_t>(r) != n * eventSize) return -1;
+
+  run->pos += n;
+  return r;
+}
+
+// _____________________________________________________________________________
+bool readKey(int file, size_t eventSize, size_t pos, uint64_t* key) {
+  ssize_t r = preadAll(file, reinterpret_cast<unsigned char*>(key),
+                       sizeof(uint64_t), pos * eventSize);
+  return r == sizeof(uint64_t);
+}
+
+// _____________________________________________________________________________
+size_t lowerBound(int file, size_t eventSize, size_t from, size_t to,
+                  uint64_t key, bool* err) {
+  while (from < to) {
+    size_t mid = from + (to - from) / 2;
+    uint64_t k;
+    if (!readKey(file, eventSize, mid, &k)) {
+      *err = true;
+      return from;
+    }
+    if (k < key) {
+      from = mid + 1;
+    } else {
+      to = mid;
+    }
+  }
+  return from;
+}
+
+// _____________________________________________________________________________
+ssize_t mergeBucket(int in, int out, size_t eventSize,
+                    const std::vector<std::vector<size_t>>& cuts,
+                    size_t bucket, size_t outPos, size_t bufEvents) {
+  size_t numRuns = cuts.size();
+
+  // short runs don't need a full read buffer
+  std::vector<size_t> bufOffs(numRuns + 1, 0);
+  for (size_t i = 0; i < numRuns; i++) {
+    bufOffs[i + 1] =
+        bufOffs[i] +
+        std::min(bufEvents, cuts[i][bucket + 1] - cuts[i][bucket]);
+  }
+
+  size_t outBufEvents =
+      std::max<size_t>(1, sj::EVENT_MERGE_BUFF_SIZE / eventSize);
+
+  std::vector<Run> runs(numRuns);
+  unsigned char* mergeBuf = new unsigned char[bufOffs.back() * eventSize];
+  unsigned char* outBuf = new unsigned char[outBufEvents * eventSize];
+  size_t outBufPos = 0;
+
+  typedef std::pair<uint64_t, size_t> HeapEntry;
+  std::priority_queue<HeapEntry, std::vector<HeapEntry>,
+                      std::greater<HeapEntry>>
+      heap;
+
+  ssize_t r = 0;
+
+  for (size_t i = 0; i < numRuns && r >= 0; i++) {
+    runs[i] = {cuts[i][bucket], cuts[i][bucket + 1],
+               mergeBuf + bufOffs[i] * eventSize, 0, 0};
+    r = fillRun(in, &runs[i], eventSize, bufOffs[i + 1] - bufOffs[i]);
+    if (r > 0) heap.push({keyOf(runs[i].buf), i});
+  }
+
+  while (!heap.empty() && r >= 0) {
+    size_t i = heap.top().second;
+    heap.pop();
+
+    Run& run = runs[i];
+    memcpy(outBuf + outBufPos * eventSize, run.buf + run.bufPos * eventSize,
+           eventSize);
+    outBufPos++;
+    run.bufPos++;
+
+    if (outBufPos == outBufEvents) {
+      r = pwriteAll(out, outBuf, outBufPos * eventSize, outPos * eventSize);
+      outPos += outBufPos;
+      outBufPos = 0;
+    }
+
+    if (run.bufPos == run.bufLen) {
+      if (fillRun(in, &run, eventSize, bufOffs[i + 1] - bufOffs[i]) < 0) {
+        r = -1;
+      }
+    }
+
+    if (run.bufPos < run.bufLen) {
+      heap.push({keyOf(run.buf + run.bufPos * eventSize), i});
+    }
+  }
+
+  if (r >= 0 && outBufPos) {
+    r = pwriteAll(out, outBuf, outBufPos * eventSize, outPos * eventSize);
+  }
+
+  delete[] mergeBuf;
+  delete[] outBuf;
+
+  return r < 0 ? -1 : 0;
+}
+}  // namespace
+
+// _____________________________________________________________________________
+unsigned char* sj::sortEvents(unsigned char* buf, unsigned char* tmp,
+                              size_t numEvents, size_t eventSize,
+                              size_t numThreads) {
+  switch (eventSize) {
+    case 32:
+      return radixSort<32>(buf, tmp, numEvents, eventSize, numThreads);
+    case 40:
+      return radixSort<40>(buf, tmp, numEvents, eventSize, numThreads);
+    case 48:
+      return radixSort<48>(buf, tmp, numEvents, eventSize, numThreads);
+    case 56:
+      return radixSort<56>(buf, tmp, numEvents, eventSize, numThreads);
+    default:
+      return radixSort<0>(buf, tmp, numEvents, eventSize, numThreads);
+  }
+}
+
+// _____________________________________________________________________________
+bool sj::eventsSorted(const unsigned char* buf, size_t numEvents,
+                      size_t eventSize) {
+  for (size_t i = 1; i < numEvents; i++) {
+    if (keyOf(buf + i * eventSize) < keyOf(buf + (i - 1) * eventSize))
+      return false;
+  }
+  return true;
+}
+
+// _____________________________________________________________________________
+std::vector<size_t> sj::coalesceEventRuns(
+    int file, size_t eventSize, const std::vector<size_t>& runBounds) {
+  if (runBounds.empty()) return {};
+
+  std::vector<size_t> ret = {runBounds.front()};
+  uint64_t last = 0;
+
+  for (size_t i = 0; i + 1 < runBounds.size(); i++) {
+    if (runBounds[i + 1] == runBounds[i]) continue;
+
+    uint64_t first;
+    if (!readKey(file, eventSize, runBounds[i], &first)) return {};
+
+    // start a new run if this one overlaps the previous ones
+    if (runBounds[i] > ret.back() && first < last) ret.push_back(runBounds[i]);
+
+    if (!readKey(file, eventSize, runBounds[i + 1] - 1, &last)) return {};
+  }
+
+  if (runBounds.back() > ret.back()) ret.push_back(runBounds.back());
+
+  return ret;
+}
+
+// _____________________________________________________________________________
+ssize_t sj::mergeEventRuns(
+    int in, int out, size_t eventSize, const std::vector<size_t>& runBounds,
+    size_t numThreads, const std::function<void(size_t, size_t)>& bucketCb) {
+  if (runBounds.size() < 2) return 0;
+
+  size_t numRuns = runBounds.size() - 1;
+  size_t numEvents = runBounds.back() - runBounds.front();
+
+  numThreads = std::max<size_t>(1, numThreads);
+  size_t numBuckets = numThreads * EVENT_MERGE_BUCKETS_PER_THREAD;
+
+  // the buckets are written concurrently into the output file
+  if (ftruncate(out, numEvents * eventSize) != 0) return -1;
+
+  bool err = false;
+
+  // split the key space into buckets of roughly equal size, using a sample of
+  // the keys of each run
+  std::vector<uint64_t> sample;
+  for (size_t i = 0; i < numRuns && !err; i++) {
+    size_t len = runBounds[i + 1] - runBounds[i];
+    for (size_t j = 0; j < std::min(numBuckets, len); j++) {
+      uint64_t k;
+      if (!readKey(in, eventSize, runBounds[i] + (len * j) / numBuckets, &k)) {
+        err = true;
+        break;
+      }
+      sample.push_back(k);
+    }
+  }
+
+  if (err) return -1;
+
+  std::sort(sample.begin(), sample.end());
+
+  // cuts[i][b] is the position of the first event of bucket b in run i
+  std::vector<std::vector<size_t>> cuts(numRuns,
+                                        std::vector<size_t>(numBuckets + 1));
+
+  for (size_t i = 0; i < numRuns && !err; i++) {
+    cuts[i][0] = runBounds[i];
+    cuts[i][numBuckets] = runBounds[i + 1];
+    for (size_t b = 1; b < numBuckets; b++) {
+      uint64_t split = sample.empty()
+                           ? std::numeric_limits<uint64_t>::max()
+                           : sample[(sample.size() * b) / numBuckets];
+      cuts[i][b] = lowerBound(in, eventSize, cuts[i][b - 1], runBounds[i + 1],
+                              split, &err);
+    }
+  }
+
+  if (err) return -1;
+
+  // position of each bucket in the output
+  std::vector<size_t> outBounds(numBuckets + 1, 0);
+  for (size_t b = 0; b < numBuckets; b++) {
+    outBounds[b + 1] = outBounds[b];
+    for (size_t i = 0; i < numRuns; i++)
+      outBounds[b + 1] += cuts[i][b + 1] - cuts[i][b];
+  }
+
+  // buckets are merged in order, so the first ones are available early
+  size_t bufEvents =
+      std::max<size_t>(1, EVENT_MERGE_BUFF_SIZE / eventSize / numThreads);
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> abort(false);
+  std::vector<ssize_t> res(numBuckets, 0);
+  std::vector<bool> done(numBuckets, false);
+  std::mutex mtx;
+  std::condition_variable cv;
+
+  std::vector<std::thread> thrds(std::min(numThreads, numBuckets));
+  for (auto& thr : thrds) {
+    thr = std::thread([&]() {
+      size_t b;
+      while (!abort && (b = next++) < numBuckets) {
+        ssize_t r = mergeBucket(in, out, eventSize, cuts, b, outBounds[b],
+                                bufEvents);
+        std::unique_lock<std::mutex> lock(mtx);
+        res[b] = r;
+        done[b] = true;
+        cv.notify_all();
+      }
+    });
+  }
+
+  ssize_t ret = numEvents * eventSize;
+
+  try {
+    for (size_t b = 0; b < numBuckets; b++) {
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]() { return done[b]; });
+      }
+
+      if (res[b] < 0) {
+        ret = -1;
+        break;
+      }
+
+      if (bucketCb && outBounds[b + 1] > outBounds[b])
+        bucketCb(outBounds[b], outBounds[b + 1]);
+    }
+  } catch (...) {
+    abort = true;
+    for (auto& thr : thrds) thr.join();
+    throw;
+  }
+
+  abort = true;
+  for (auto& thr : thrds) thr.join();
+
+  return ret;
+}
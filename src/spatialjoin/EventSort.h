@@ -0,0 +1,60 @@
+// Copyright 2023, University of Freiburg
+// Authors: Patrick Brosi <brosi@cs.uni-freiburg.de>.
+
+#ifndef SPATIALJOINS_EVENTSORT_H_
+#define SPATIALJOINS_EVENTSORT_H_
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace sj {
+
+// size in bytes of the sorted runs the events are spilled to disk in, if no
+// memory budget is given
+const static size_t EVENT_SORT_RUN_SIZE = 1024 * 1024 * 512;
+
+// sorted runs hold at least this many events, whatever the memory budget
+const static size_t EVENT_SORT_MIN_RUN_EVENTS = 16;
+
+// size in bytes of the read buffers per run during the k-way merge, shared
+// by all merging threads
+const static size_t EVENT_MERGE_BUFF_SIZE = 1024 * 1024;
+
+// number of key range buckets per thread which are merged independently
+const static size_t EVENT_MERGE_BUCKETS_PER_THREAD = 4;
+
+// Sort numEvents fixed-size events of eventSize bytes held in buf by their
+// leading 64 bit key, using a parallel LSD radix sort with numThreads
+// threads. tmp must have the same size as buf. Returns whichever of buf and
+// tmp holds the sorted events.
+unsigned char* sortEvents(unsigned char* buf, unsigned char* tmp,
+                          size_t numEvents, size_t eventSize,
+                          size_t numThreads);
+
+// Returns true if the numEvents events of eventSize bytes held in buf are
+// already sorted by their leading 64 bit key.
+bool eventsSorted(const unsigned char* buf, size_t numEvents,
+                  size_t eventSize);
+
+// Coalesce consecutive sorted runs of events in file which are already in
+// order, that is, each run starts with a key not smaller than the last key
+// of the run before it, into single runs. Empty runs are dropped. Returns
+// the new run bounds, or an empty vector on error.
+std::vector<size_t> coalesceEventRuns(int file, size_t eventSize,
+                                      const std::vector<size_t>& runBounds);
+
+// Merge the sorted runs of events in file in into file out. Run i holds the
+// events [runBounds[i], runBounds[i + 1]). The key space is split into
+// buckets which are merged concurrently by numThreads threads. Once all
+// buckets up to bucket b are merged, bucketCb(from, to) is called from the
+// calling thread with the range of events of bucket b in out. Returns -1 on
+// error.
+ssize_t mergeEventRuns(int in, int out, size_t eventSize,
+                       const std::vector<size_t>& runBounds, size_t numThreads,
+                       const std::function<void(size_t, size_t)>& bucketCb);
+}  // namespace sj
+
+#endif
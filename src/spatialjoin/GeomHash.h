@@ -0,0 +1,109 @@
+// Copyright 2023, University of Freiburg
+// Authors: Patrick Brosi <brosi@cs.uni-freiburg.de>.
+
+#ifndef SPATIALJOINS_GEOMHASH_H_
+#define SPATIALJOINS_GEOMHASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "util/geo/Geo.h"
+
+namespace sj {
+
+// 128 bit content hash of a geometry, 0 means "not hashed"
+struct GeomHash {
+  uint64_t lo = 0;
+  uint64_t hi = 0;
+
+  bool isNull() const { return lo == 0 && hi == 0; }
+};
+
+inline bool operator==(const GeomHash& a, const GeomHash& b) {
+  return a.lo == b.lo && a.hi == b.hi;
+}
+
+struct GeomHashHash {
+  size_t operator()(const GeomHash& h) const { return h.lo; }
+};
+
+// Incremental hash over the integer coordinates of a geometry, with two
+// independently seeded 64 bit lanes which are finalized separately. Equal
+// hashes only mark candidates for equal geometries; if given a buffer, the
+// hashed values are appended to it so that candidates can be compared.
+class GeomHasher {
+ public:
+  explicit GeomHasher(std::string* bytes) : _bytes(bytes) {}
+
+  void add(uint64_t v) {
+    if (_bytes) _bytes->append(reinterpret_cast<const char*>(&v), sizeof(v));
+    _lo = (_lo ^ v) * 0x9E3779B97F4A7C15ull;
+    _lo ^= _lo >> 32;
+    _hi = (_hi + v) * 0xC2B2AE3D27D4EB4Full;
+    _hi = (_hi << 31) | (_hi >> 33);
+    _n++;
+  }
+
+  void add(const util::geo::I32Point& p) {
+    add((static_cast<uint64_t>(static_cast<uint32_t>(p.getX())) << 32) |
+        static_cast<uint32_t>(p.getY()));
+  }
+
+  void add(const util::geo::I32Line& l) {
+    add(l.size());
+    for (const auto& p : l) add(p);
+  }
+
+  GeomHash hash() const {
+    GeomHash ret{fmix(_lo ^ _n), fmix(_hi + _n)};
+    if (ret.isNull()) ret.lo = 1;
+    return ret;
+  }
+
+ private:
+  static uint64_t fmix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDull;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ull;
+    k ^= k >> 33;
+    return k;
+  }
+
+  uint64_t _lo = 0x243F6A8885A308D3ull;
+  uint64_t _hi = 0x13198A2E03707344ull;
+  uint64_t _n = 0;
+  std::string* _bytes;
+};
+
+// ____________________________________________________________________________
+inline GeomHash geomHash(const util::geo::I32Point& p, std::string* bytes) {
+  GeomHasher h(bytes);
+  h.add(1);
+  h.add(p);
+  return h.hash();
+}
+
+// ____________________________________________________________________________
+inline GeomHash geomHash(const util::geo::I32Line& l, std::string* bytes) {
+  GeomHasher h(bytes);
+  h.add(2);
+  h.add(l);
+  return h.hash();
+}
+
+// ____________________________________________________________________________
+inline GeomHash geomHash(const util::geo::I32Polygon& poly,
+                         std::string* bytes) {
+  GeomHasher h(bytes);
+  h.add(3);
+  h.add(poly.getOuter());
+  h.add(poly.getInners().size());
+  for (const auto& inner : poly.getInners()) h.add(inner);
+  return h.hash();
+}
+
+}  // namespace sj
+
+#endif
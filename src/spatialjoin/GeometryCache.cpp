@@ -1,16 +1,19 @@
 // Copyright 2023, University of Freiburg
 // Authors: Patrick Brosi <brosi@cs.uni-freiburg.de>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <mutex>
+#include <stdexcept>
 #include <vector>
 
 #include "GeometryCache.h"
 #include "util/geo/Geo.h"
 
-const static size_t MAX_MEM_CACHE_SIZE = 1 * 1024 * 1024 * 20l;
-
 // ____________________________________________________________________________
 template <typename W>
 std::shared_ptr<W> sj::GeometryCache<W>::get(size_t off, ssize_t desTid) const {
@@ -20,61 +23,378 @@ std::shared_ptr<W> sj::GeometryCache<W>::get(size_t off, ssize_t desTid) const {
     // completely circumvent cache system
     return std::make_shared<W>(_memStore.at(off));
   } else if (desTid == -1) {
-    // special cache for large geometries
+    // separate read stream for large geometries
     tid = _numThreads;
   } else {
     tid = desTid % _numThreads;
   }
 
-  std::unique_lock<std::mutex> lock(_mutexes[tid]);
+  auto shard = shardOf(off, desTid);
+
+  {
+    std::unique_lock<std::mutex> lock(shard->mtx);
+
+    // check if value is in cache
+    auto it = shard->idMap.find(off);
+
+    if (it != shard->idMap.end()) {
+      _hits++;
+      touch(shard, it->second);
+      return it->second->second.val;
+    }
+  }
+
+  _misses++;
+
+  // if not, load without holding the shard lock, cache and return
+  std::pair<size_t, W> val;
+
+  {
+    std::unique_lock<std::mutex> lock(_mutexes[tid]);
+    val = getFrom(off < _baseSize ? off : off - _baseSize,
+                  readStream(off, tid));
+  }
+
+  std::unique_lock<std::mutex> lock(shard->mtx);
+  return cache(shard, off, std::move(val.second), val.first);
+}
+
+// ____________________________________________________________________________
+template <typename W>
+void sj::GeometryCache<W>::willNeed(size_t off) const {
+  if (_inMemory) return;
+
+  const MappedFile& mf = off < _baseSize ? _baseMap : _geomsMap;
+  if (!mf.data) return;
+
+  size_t start = off < _baseSize ? off : off - _baseSize;
+  if (start >= mf.size) return;
+
+  // madvise() wants a page aligned address
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t from = start - start % pageSize;
+  size_t to = std::min(mf.size, start + GEOM_READAHEAD_SIZE);
+
+  madvise(mf.data + from, to - from, MADV_WILLNEED);
+}
+
+// ____________________________________________________________________________
+template <typename W>
+void sj::GeometryCache<W>::prefetch(size_t off, bool large) const {
+  if (_inMemory) return;
 
-  // check if value is in cache
-  auto it = _idMap[tid].find(off);
+  auto shard = shardOf(off, large ? -1 : 0);
 
-  if (it == _idMap[tid].end()) {
-    // if not, load, cache and return
-    const auto& val = getFrom(off, _geomsFReads[tid]);
-    return cache(off, val.second, val.first, tid);
+  {
+    std::unique_lock<std::mutex> lock(shard->mtx);
+    if (shard->idMap.count(off)) return;
   }
 
-  // if in cache, move to front of list and return
-  // splice only changes pointers in the linked list, no copying here
-  _vals[tid].splice(_vals[tid].begin(), _vals[tid], it->second);
+  // the last read stream belongs to the prefetcher
+  size_t tid = _numThreads + 1;
+  std::pair<size_t, W> val;
+
+  {
+    std::unique_lock<std::mutex> lock(_mutexes[tid]);
+    val = getFrom(off < _baseSize ? off : off - _baseSize,
+                  readStream(off, tid));
+  }
+
+  std::unique_lock<std::mutex> lock(shard->mtx);
+  cache(shard, off, std::move(val.second), val.first);
+}
+
+// ____________________________________________________________________________
+template <typename W>
+sj::CacheShard<W>* sj::GeometryCache<W>::shardOf(size_t off,
+                                                 ssize_t tid) const {
+  if (tid == -1) return &_shards[GEOM_CACHE_SHARDS];
+  return &_shards[shardIndex(off)];
+}
+
+// ____________________________________________________________________________
+template <typename W>
+size_t sj::GeometryCache<W>::shardIndex(size_t off) {
+  // offsets are not uniformly distributed in their lower bits
+  uint64_t h = static_cast<uint64_t>(off) * 0x9E3779B97F4A7C15ull;
+  return (h >> 32) % GEOM_CACHE_SHARDS;
+}
+
+// ____________________________________________________________________________
+template <typename W>
+std::istream& sj::GeometryCache<W>::readStream(size_t off, size_t tid) const {
+  if (off < _baseSize) {
+    if (_baseMap.data) return _baseMap.reads[tid]->str;
+    return _baseFReads[tid];
+  }
 
-  return it->second->second.val;
+  if (_geomsMap.data) return _geomsMap.reads[tid]->str;
+  return _geomsFReads[tid];
 }
 
 // ____________________________________________________________________________
 template <typename W>
-std::shared_ptr<W> sj::GeometryCache<W>::cache(size_t off, const W& val,
-                                               size_t estSize,
-                                               size_t tid) const {
+void sj::GeometryCache<W>::mapFile(int file, size_t size,
+                                   MappedFile* mf) const {
+  unmapFile(mf);
+
+  if (file < 0 || size == 0) return;
+
+  void* data = mmap(0, size, PROT_READ, MAP_SHARED, file, 0);
+
+  // fall back to the fstreams
+  if (data == MAP_FAILED) return;
+
+  mf->data = reinterpret_cast<char*>(data);
+  mf->size = size;
+  mf->reads.resize(_numThreads + 2);
+
+  for (auto& read : mf->reads) {
+    read.reset(new MappedStream());
+    read->buf.reset(mf->data, mf->size);
+  }
+}
+
+// ____________________________________________________________________________
+template <typename W>
+void sj::GeometryCache<W>::unmapFile(MappedFile* mf) {
+  if (mf->data) munmap(mf->data, mf->size);
+  mf->data = 0;
+  mf->size = 0;
+  mf->reads.clear();
+}
+
+// ____________________________________________________________________________
+template <typename W>
+std::shared_ptr<W> sj::GeometryCache<W>::cache(CacheShard<W>* shard,
+                                               size_t off, W&& val,
+                                               size_t estSize) const {
+  // another thread may have loaded the same geometry in the meantime
+  auto it = shard->idMap.find(off);
+  if (it != shard->idMap.end()) {
+    touch(shard, it->second);
+    return it->second->second.val;
+  }
+
+  if (_policy == CACHE_S3FIFO) {
+    return cacheS3FIFO(shard, off, std::move(val), estSize);
+  }
+
+  size_t maxSize = shardMaxSize(shard);
+  size_t maxNumElements = shardMaxNumElements(shard);
+
   // if cache is too large, pop last elements until we have space
-  while (_maxSize > 0 && _vals[tid].size() > 0 && _valSizes[tid] > _maxSize) {
-    auto last = _vals[tid].rbegin();
-    _valSizes[tid] -= last->second.estimatedSize;
-    _idMap[tid].erase(last->first);
-    _vals[tid].pop_back();
+  while (maxSize > 0 && shard->vals.size() > 0 && shard->valSize > maxSize) {
+    auto last = shard->vals.rbegin();
+    shard->valSize -= last->second.estimatedSize;
+    shard->idMap.erase(last->first);
+    shard->vals.pop_back();
   }
 
   // push value to front
-  _vals[tid].push_front({off, {estSize, std::make_shared<W>(val)}});
+  shard->vals.push_front(
+      {off, {estSize, std::make_shared<W>(std::move(val))}});
 
   // if cache has too many elements, pop last element
-  if (_maxNumElements > 0 && _vals[tid].size() > _maxNumElements) {
-    auto last = _vals[tid].rbegin();
-    _valSizes[tid] -= last->second.estimatedSize;
-    _idMap[tid].erase(last->first);
-    _vals[tid].pop_back();
+  if (maxNumElements > 0 && shard->vals.size() > maxNumElements) {
+    auto last = shard->vals.rbegin();
+    shard->valSize -= last->second.estimatedSize;
+    shard->idMap.erase(last->first);
+    shard->vals.pop_back();
   }
 
   // set map to front iterator
-  _idMap[tid][off] = _vals[tid].begin();
+  shard->idMap[off] = shard->vals.begin();
 
   // increase total estimated size
-  _valSizes[tid] += estSize;
+  shard->valSize += estSize;
+
+  return shard->vals.front().second.val;
+}
+
+// ____________________________________________________________________________
+template <typename W>
+void sj::GeometryCache<W>::evict(size_t off) const {
+  if (_inMemory) return;
+
+  // the geometry may have been read as a large geometry
+  for (auto shard : {shardOf(off, 0), shardOf(off, -1)}) {
+    std::unique_lock<std::mutex> lock(shard->mtx);
+
+    // it won't come back, so it isn't kept in the ghost queue either
+    forget(shard, off);
+
+    auto it = shard->idMap.find(off);
+    if (it == shard->idMap.end()) continue;
+
+    auto entry = it->second;
+    shard->valSize -= entry->second.estimatedSize;
+
+    if (entry->second.small) {
+      shard->smallSize -= entry->second.estimatedSize;
+      shard->small.erase(entry);
+    } else {
+      shard->vals.erase(entry);
+    }
+
+    shard->idMap.erase(it);
+  }
+}
+
+// ____________________________________________________________________________
+template <typename W>
+bool sj::GeometryCache<W>::isLargeShard(const CacheShard<W>* shard) const {
+  return shard == &_shards[GEOM_CACHE_SHARDS];
+}
+
+// ____________________________________________________________________________
+template <typename W>
+size_t sj::GeometryCache<W>::shardShare(const CacheShard<W>* shard,
+                                        size_t budget) const {
+  if (budget == 0) return 0;
+
+  // the large geometries get a fixed part of the budget, the other shards
+  // an equal part of the rest
+  size_t large = std::max<size_t>(1, budget / GEOM_CACHE_LARGE_DIV);
+  if (isLargeShard(shard)) return large;
 
-  return _vals[tid].front().second.val;
+  return std::max<size_t>(
+      1, (budget - large + GEOM_CACHE_SHARDS - 1) / GEOM_CACHE_SHARDS);
+}
+
+// ____________________________________________________________________________
+template <typename W>
+size_t sj::GeometryCache<W>::shardMaxSize(const CacheShard<W>* shard) const {
+  return shardShare(shard, _maxSize);
+}
+
+// ____________________________________________________________________________
+template <typename W>
+size_t sj::GeometryCache<W>::shardMaxNumElements(
+    const CacheShard<W>* shard) const {
+  return shardShare(shard, _maxNumElements);
+}
+
+// ____________________________________________________________________________
+template <typename W>
+void sj::GeometryCache<W>::touch(
+    CacheShard<W>* shard, typename CacheShard<W>::ValList::iterator it) const {
+  if (_policy == CACHE_S3FIFO) {
+    // hits only count, the entries are not moved
+    if (it->second.freq < 3) it->second.freq++;
+    return;
+  }
+
+  // move to front of list, splice only changes pointers in the linked list,
+  // no copying here
+  shard->vals.splice(shard->vals.begin(), shard->vals, it);
+}
+
+// ____________________________________________________________________________
+template <typename W>
+std::shared_ptr<W> sj::GeometryCache<W>::cacheS3FIFO(CacheShard<W>* shard,
+                                                     size_t off, W&& val,
+                                                     size_t estSize) const {
+  size_t maxSize = shardMaxSize(shard);
+  size_t maxNumElements = shardMaxNumElements(shard);
+
+  bool seen = forget(shard, off);
+  auto ret = std::make_shared<W>(std::move(val));
+
+  // large geometries are the most expensive to decode, they skip the small
+  // queue
+  if (isLargeShard(shard)) seen = true;
+
+  // geometries too large for the small queue would flush it entirely, they
+  // are only admitted on their second request
+  if (!seen && maxSize > 0 && estSize > maxSize / CACHE_SMALL_QUEUE_DIV) {
+    remember(shard, off);
+    return ret;
+  }
+
+  auto& queue = seen ? shard->vals : shard->small;
+  queue.push_front({off, {estSize, ret, 0, !seen}});
+  shard->idMap[off] = queue.begin();
+  shard->valSize += estSize;
+  if (!seen) shard->smallSize += estSize;
+
+  while (!shard->idMap.empty() &&
+         ((maxSize > 0 && shard->valSize > maxSize) ||
+          (maxNumElements > 0 && shard->idMap.size() > maxNumElements))) {
+    evictS3FIFO(shard);
+  }
+
+  return ret;
+}
+
+// ____________________________________________________________________________
+template <typename W>
+void sj::GeometryCache<W>::evictS3FIFO(CacheShard<W>* shard) const {
+  size_t maxSmallSize = shardMaxSize(shard) / CACHE_SMALL_QUEUE_DIV;
+  size_t maxSmallNumElements =
+      shardMaxNumElements(shard) / CACHE_SMALL_QUEUE_DIV;
+
+  bool smallFull =
+      (maxSmallSize > 0 && shard->smallSize > maxSmallSize) ||
+      (maxSmallNumElements > 0 && shard->small.size() > maxSmallNumElements);
+
+  if (!shard->small.empty() && (smallFull || shard->vals.empty())) {
+    auto last = std::prev(shard->small.end());
+    shard->smallSize -= last->second.estimatedSize;
+
+    if (last->second.freq > 0) {
+      // requested again while in the small queue, move to the main queue
+      last->second.freq = 0;
+      last->second.small = false;
+      shard->vals.splice(shard->vals.begin(), shard->small, last);
+      return;
+    }
+
+    remember(shard, last->first);
+    shard->valSize -= last->second.estimatedSize;
+    shard->idMap.erase(last->first);
+    shard->small.erase(last);
+    return;
+  }
+
+  auto last = std::prev(shard->vals.end());
+
+  if (last->second.freq > 0) {
+    // requested since the last round, reinsert
+    last->second.freq--;
+    shard->vals.splice(shard->vals.begin(), shard->vals, last);
+    return;
+  }
+
+  shard->valSize -= last->second.estimatedSize;
+  shard->idMap.erase(last->first);
+  shard->vals.erase(last);
+}
+
+// ____________________________________________________________________________
+template <typename W>
+void sj::GeometryCache<W>::remember(CacheShard<W>* shard, size_t off) const {
+  if (shard->ghostMap.count(off)) return;
+
+  shard->ghost.push_front(off);
+  shard->ghostMap[off] = shard->ghost.begin();
+
+  while (shard->ghost.size() >
+         std::max(CACHE_MIN_GHOSTS, shard->idMap.size())) {
+    shard->ghostMap.erase(shard->ghost.back());
+    shard->ghost.pop_back();
+  }
+}
+
+// ____________________________________________________________________________
+template <typename W>
+bool sj::GeometryCache<W>::forget(CacheShard<W>* shard, size_t off) const {
+  auto it = shard->ghostMap.find(off);
+  if (it == shard->ghostMap.end()) return false;
+
+  shard->ghost.erase(it->second);
+  shard->ghostMap.erase(it);
+  return true;
 }
 
 // ____________________________________________________________________________
@@ -320,7 +640,7 @@ size_t sj::GeometryCache<W>::add(const std::string& raw) {
     const auto& val = getFrom(0, ss);
     _memStore[ret] = std::move(val.second);
 
-    if (_geomsOffset > MAX_MEM_CACHE_SIZE) {
+    if (_geomsOffset > MEM_STORE_MAX_SIZE) {
       _inMemory = false;
 
       for (const auto& val : _memStore) {
@@ -540,6 +860,99 @@ void sj::GeometryCache<W>::flush() {
     _geomsF.flush();
     _geomsF.close();
   }
+
+  // no more geometries will be added
+  if (!_inMemory) mapFile(_geomsFd, _geomsOffset - _baseSize, &_geomsMap);
+}
+
+// ____________________________________________________________________________
+template <typename W>
+void sj::GeometryCache<W>::store(const std::string& fname) const {
+  std::ofstream out(fname, std::ios::out | std::ios::binary | std::ios::trunc);
+
+  if (!out.good()) {
+    throw std::runtime_error("Could not open geometry file " + fname);
+  }
+
+  if (_inMemory) {
+    // the keys of the mem store are the offsets the values would have had
+    // in the file, so writing them in order keeps them valid
+    for (const auto& val : _memStore) writeTo(val.second, out);
+  } else {
+    std::unique_lock<std::mutex> lock(_mutexes[0]);
+    if (_baseSize) copyTo(_baseFReads[0], _baseSize, out);
+    copyTo(_geomsFReads[0], _geomsOffset - _baseSize, out);
+  }
+
+  out.flush();
+
+  if (!out.good()) {
+    throw std::runtime_error("Could not write geometry file " + fname);
+  }
+}
+
+// ____________________________________________________________________________
+template <typename W>
+void sj::GeometryCache<W>::copyTo(std::istream& in, size_t len,
+                                  std::ostream& out) const {
+  in.clear();
+  in.seekg(0);
+
+  std::vector<char> buf(WRITE_BUFF_SIZE);
+
+  while (len > 0) {
+    size_t n = std::min(len, WRITE_BUFF_SIZE);
+    in.read(buf.data(), n);
+    if (!in.good()) {
+      throw std::runtime_error("Could not read geometry file " + _fName);
+    }
+    out.write(buf.data(), n);
+    len -= n;
+  }
+}
+
+// ____________________________________________________________________________
+template <typename W>
+void sj::GeometryCache<W>::load(const std::string& fname) {
+  _baseFReads.resize(_geomsFReads.size());
+
+  for (size_t i = 0; i < _baseFReads.size(); i++) {
+    if (_baseFReads[i].is_open()) _baseFReads[i].close();
+    _baseFReads[i].clear();
+    _baseFReads[i].open(fname, std::ios::in | std::ios::binary);
+
+    if (!_baseFReads[i].good()) {
+      throw std::runtime_error("Could not open geometry file " + fname);
+    }
+  }
+
+  // drop everything cached so far
+  for (auto& shard : _shards) {
+    std::unique_lock<std::mutex> lock(shard.mtx);
+    shard.vals.clear();
+    shard.small.clear();
+    shard.ghost.clear();
+    shard.ghostMap.clear();
+    shard.idMap.clear();
+    shard.valSize = 0;
+    shard.smallSize = 0;
+  }
+
+  _baseFReads[0].seekg(0, std::ios::end);
+  _baseSize = _baseFReads[0].tellg();
+  _baseFReads[0].seekg(0);
+
+  int baseFd = open(fname.c_str(), O_RDONLY);
+  mapFile(baseFd, _baseSize, &_baseMap);
+
+  // the mapping stays valid after the file is closed
+  if (baseFd >= 0) close(baseFd);
+
+  // geometries added from now on are appended to the (still empty)
+  // temporary file, behind the loaded ones
+  _geomsOffset = _baseSize;
+  _memStore = {};
+  _inMemory = false;
 }
 
 // ____________________________________________________________________________
@@ -745,10 +1158,10 @@ template <typename W>
 std::pair<size_t, size_t> sj::GeometryCache<W>::size() const {
   size_t numEntries = 0;
   size_t bytes = 0;
-  for (size_t tid = 0; tid < _vals.size(); tid++) {
-    std::unique_lock<std::mutex> lock(_mutexes[tid]);
-    numEntries += _vals[tid].size();
-    bytes += _valSizes[tid];
+  for (auto& shard : _shards) {
+    std::unique_lock<std::mutex> lock(shard.mtx);
+    numEntries += shard.vals.size() + shard.small.size();
+    bytes += shard.valSize;
   }
   return {numEntries, bytes};
 }
@@ -4,13 +4,19 @@
 #ifndef SPATIALJOINS_GEOMETRYCACHE_H_
 #define SPATIALJOINS_GEOMETRYCACHE_H_
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <list>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <streambuf>
 #include <unordered_map>
+#include <vector>
 
 #include "BoxIds.h"
 #include "util/geo/Geo.h"
@@ -109,10 +115,110 @@ template <typename W>
 struct ValEntry {
   size_t estimatedSize;
   std::shared_ptr<W> val;
+
+  // S3-FIFO: number of requests since the entry was last looked at by the
+  // eviction (at most 3), and whether it is in the small queue
+  uint8_t freq = 0;
+  bool small = false;
+};
+
+// eviction policy of the geometry caches
+enum CachePolicy : uint8_t {
+  // least recently used
+  CACHE_LRU = 0,
+  // S3-FIFO: new geometries enter a small FIFO queue and are only moved to
+  // the main FIFO queue if they are requested again before they reach its
+  // end. Geometries evicted from the small queue are remembered in a ghost
+  // queue (ids only) and go straight to the main queue if they come back.
+  // One-off geometries thus never displace the ones requested repeatedly.
+  CACHE_S3FIFO = 1
 };
 
 const static size_t WRITE_BUFF_SIZE = 1024 * 1024 * 4l;
 
+// geometries are kept decoded in memory, bypassing the cache, until their
+// serialized size exceeds this
+const static size_t MAX_MEM_CACHE_SIZE = 1 * 1024 * 1024 * 20l;
+
+// number of shards of the cache shared by all threads, each with its own
+// lock and LRU list, and an equal part of the memory budget
+const static size_t GEOM_CACHE_SHARDS = 64;
+
+// the extra shard for large geometries gets 1/GEOM_CACHE_LARGE_DIV of the
+// budget, the others share the rest
+const static size_t GEOM_CACHE_LARGE_DIV = 4;
+
+// S3-FIFO: the small queue holds 1/CACHE_SMALL_QUEUE_DIV of the budget,
+// geometries larger than that are only admitted if they are in the ghost
+// queue, which remembers at least CACHE_MIN_GHOSTS ids. The large shard
+// admits everything straight to its main queue
+const static size_t CACHE_SMALL_QUEUE_DIV = 10;
+const static size_t CACHE_MIN_GHOSTS = 16;
+
+// one shard of the shared cache
+template <typename W>
+struct CacheShard {
+  typedef std::list<std::pair<size_t, ValEntry<W>>> ValList;
+
+  std::mutex mtx;
+
+  // the LRU list, or the main queue of S3-FIFO
+  ValList vals;
+
+  // S3-FIFO: the small queue and the ghost queue
+  ValList small;
+  std::list<size_t> ghost;
+  std::unordered_map<size_t, std::list<size_t>::iterator> ghostMap;
+
+  std::unordered_map<size_t, typename ValList::iterator> idMap;
+  size_t valSize = 0;
+  size_t smallSize = 0;
+};
+
+// Read-only stream buffer over a memory mapped geometry file. Seeking only
+// moves the read pointer and reads are plain copies out of the mapping, so
+// a geometry is decoded without any system call.
+class MappedBuf : public std::streambuf {
+ public:
+  void reset(const char* data, size_t size) {
+    char* d = const_cast<char*>(data);
+    setg(d, d, d + size);
+  }
+
+ protected:
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override {
+    off_type base = 0;
+    if (dir == std::ios_base::cur) base = gptr() - eback();
+    if (dir == std::ios_base::end) base = egptr() - eback();
+    return seekpos(pos_type(base + off), which);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode) override {
+    off_type p = pos;
+    if (p < 0 || p > egptr() - eback()) return pos_type(off_type(-1));
+    setg(eback(), eback() + p, egptr());
+    return pos;
+  }
+};
+
+// number of bytes from the start of a geometry that are read ahead by
+// willNeed(), longer geometries are read on demand
+const static size_t GEOM_READAHEAD_SIZE = 64 * 1024;
+
+// per-thread read stream over a mapped geometry file
+struct MappedStream {
+  MappedBuf buf;
+  std::istream str{&buf};
+};
+
+// a memory mapped geometry file, with a read stream for each thread
+struct MappedFile {
+  char* data = 0;
+  size_t size = 0;
+  std::vector<std::unique_ptr<MappedStream>> reads;
+};
+
 struct StorageOptions {
   bool storeOBB;
   bool storeInnerOuter;
@@ -121,24 +227,26 @@ struct StorageOptions {
 template <typename W>
 class GeometryCache {
  public:
-  GeometryCache(const StorageOptions& opts, size_t maxSize, size_t maxNumElements, size_t numthreads,
+  GeometryCache(const StorageOptions& opts, size_t maxSize,
+                size_t maxNumElements, CachePolicy policy, size_t numthreads,
                 const std::string& dir)
-      : GeometryCache(opts, maxSize, maxNumElements, numthreads, dir,
+      : GeometryCache(opts, maxSize, maxNumElements, policy, numthreads, dir,
                       ".spatialjoin"){};
-  GeometryCache(const StorageOptions& opts, size_t maxSize, size_t maxNumElements, size_t numthreads,
+  GeometryCache(const StorageOptions& opts, size_t maxSize,
+                size_t maxNumElements, CachePolicy policy, size_t numthreads,
                 const std::string& dir, const std::string& tmpPrefix)
       : _opts(opts),
         _maxSize(maxSize),
         _maxNumElements(maxNumElements),
         _numThreads(numthreads),
+        _policy(policy),
         _dir(dir),
         _tmpPrefix(tmpPrefix),
-        _mutexes(numthreads + 1) {
-    _geomsFReads.resize(numthreads + 1);
-
-    _vals.resize(numthreads + 1);
-    _valSizes.resize(numthreads + 1);
-    _idMap.resize(numthreads + 1);
+        _shards(GEOM_CACHE_SHARDS + 1),
+        _mutexes(numthreads + 2) {
+    // a read stream for each thread, one for the large geometries and one
+    // for the prefetcher
+    _geomsFReads.resize(numthreads + 2);
 
     _fName = getFName();
 
@@ -150,6 +258,10 @@ class GeometryCache {
     for (size_t i = 0; i < _geomsFReads.size(); i++) {
       _geomsFReads[i].open(_fName, std::ios::in | std::ios::binary);
     }
+
+    // mapped once all geometries have been written
+    _geomsFd = open(_fName.c_str(), O_RDONLY);
+
     unlink(_fName.c_str());
   }
 
@@ -158,7 +270,13 @@ class GeometryCache {
     for (size_t i = 0; i < _geomsFReads.size(); i++) {
       if (_geomsFReads[i].is_open()) _geomsFReads[i].close();
     }
+    for (size_t i = 0; i < _baseFReads.size(); i++) {
+      if (_baseFReads[i].is_open()) _baseFReads[i].close();
+    }
     if (_writeBuffer) delete[] _writeBuffer;
+    unmapFile(&_geomsMap);
+    unmapFile(&_baseMap);
+    if (_geomsFd >= 0) close(_geomsFd);
   }
 
   size_t add(const std::string& raw);
@@ -166,32 +284,59 @@ class GeometryCache {
 
   std::shared_ptr<W> get(size_t off, ssize_t tid) const;
   std::pair<size_t, W> getFrom(size_t off, std::istream& str) const;
-  std::shared_ptr<W> cache(size_t off, const W& val, size_t estSize,
-                           size_t tid) const;
+  std::shared_ptr<W> cache(CacheShard<W>* shard, size_t off, W&& val,
+                           size_t estSize) const;
 
   std::shared_ptr<W> get(size_t off) const { return get(off, 0); }
 
   std::pair<size_t, size_t> size() const;
 
+  // shard of the geometry at off, unless it is read as a large geometry
+  static size_t shardIndex(size_t off);
+
+  // number of cache hits and misses so far
+  std::pair<size_t, size_t> hits() const { return {_hits, _misses}; }
+
+  // drop a geometry that will not be requested again, to free its space for
+  // geometries that are still in use
+  void evict(size_t off) const;
+
+  // ask the kernel to read the pages of the geometry at off in the
+  // background, without waiting for them
+  void willNeed(size_t off) const;
+
+  // load the geometry at off into the cache if it isn't there yet, through
+  // a read stream of its own
+  void prefetch(size_t off, bool large) const;
+
   void flush();
 
+  // write the cached geometries to fname, such that their offsets stay valid
+  void store(const std::string& fname) const;
+
+  // read the geometries from a file written by store(), replaces everything
+  // added so far. Geometries added afterwards are stored behind them
+  void load(const std::string& fname);
+
   GeometryCache& operator=(GeometryCache&& other) {
     other._geomsF.flush();
     _geomsF = std::move(other._geomsF);
     _geomsFReads = std::move(other._geomsFReads);
     _geomsOffset = other._geomsOffset;
 
-    _vals = std::move(other._vals);
-    _idMap = std::move(other._idMap);
+    _shards = std::move(other._shards);
     _maxSize = other._maxSize;
     _maxNumElements = other._maxNumElements;
     _dir = other._dir;
     _fName = other._fName;
     _numThreads = other._numThreads;
+    MEM_STORE_MAX_SIZE = other.MEM_STORE_MAX_SIZE;
 
     return *this;
   }
 
+  size_t MEM_STORE_MAX_SIZE = MAX_MEM_CACHE_SIZE;
+
  private:
   std::string getFName() const;
   size_t readLine(std::istream& str, util::geo::I32XSortedLine& ret) const;
@@ -199,6 +344,22 @@ class GeometryCache {
                           std::ostream& str);
 
   size_t readPoly(std::istream& str, util::geo::I32XSortedPolygon& ret) const;
+  std::istream& readStream(size_t off, size_t tid) const;
+  CacheShard<W>* shardOf(size_t off, ssize_t tid) const;
+  bool isLargeShard(const CacheShard<W>* shard) const;
+  size_t shardShare(const CacheShard<W>* shard, size_t budget) const;
+  size_t shardMaxSize(const CacheShard<W>* shard) const;
+  size_t shardMaxNumElements(const CacheShard<W>* shard) const;
+  void touch(CacheShard<W>* shard,
+             typename CacheShard<W>::ValList::iterator it) const;
+  std::shared_ptr<W> cacheS3FIFO(CacheShard<W>* shard, size_t off, W&& val,
+                                 size_t estSize) const;
+  void evictS3FIFO(CacheShard<W>* shard) const;
+  void remember(CacheShard<W>* shard, size_t off) const;
+  bool forget(CacheShard<W>* shard, size_t off) const;
+  void mapFile(int file, size_t size, MappedFile* mf) const;
+  static void unmapFile(MappedFile* mf);
+  void copyTo(std::istream& in, size_t len, std::ostream& out) const;
   static size_t writePoly(const util::geo::I32XSortedPolygon& ret,
                           std::ostream& str);
 
@@ -206,14 +367,25 @@ class GeometryCache {
   mutable std::vector<std::fstream> _geomsFReads;
   size_t _geomsOffset = 0;
 
-  mutable std::vector<std::list<std::pair<size_t, ValEntry<W>>>> _vals;
-  mutable std::vector<std::unordered_map<
-      size_t, typename std::list<std::pair<size_t, ValEntry<W>>>::iterator>>
-      _idMap;
-  mutable std::vector<size_t> _valSizes;
+  // geometries loaded from a file written by store(), at offsets below
+  // _baseSize
+  mutable std::vector<std::fstream> _baseFReads;
+  size_t _baseSize = 0;
+
+  // the geometry files are memory mapped for reading once they are
+  // complete, the fstreams above are only used if that fails
+  int _geomsFd = -1;
+  MappedFile _geomsMap;
+  MappedFile _baseMap;
 
   StorageOptions _opts;
+
+  // the budget of all threads together
   size_t _maxSize, _maxNumElements, _numThreads;
+  CachePolicy _policy;
+
+  mutable std::atomic<size_t> _hits{0};
+  mutable std::atomic<size_t> _misses{0};
   std::string _dir, _tmpPrefix;
   std::string _fName;
 
@@ -222,6 +394,12 @@ class GeometryCache {
 
   char* _writeBuffer = 0;
 
+  // the cache shared by all threads, geometries are spread over the first
+  // GEOM_CACHE_SHARDS shards by their offset, the last one holds the large
+  // geometries
+  mutable std::vector<CacheShard<W>> _shards;
+
+  // guard the read streams of each thread
   mutable std::vector<std::mutex> _mutexes;
 };
 }  // namespace sj
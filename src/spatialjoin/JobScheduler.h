@@ -0,0 +1,194 @@
+// Copyright 2023, University of Freiburg
+// Authors: Patrick Brosi <brosi@cs.uni-freiburg.de>.
+
+#ifndef SPATIALJOINS_JOBSCHEDULER_H_
+#define SPATIALJOINS_JOBSCHEDULER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+namespace sj {
+
+// added batches are split into chunks of at most this many jobs and this
+// estimated cost, which is the granularity at which idle workers steal work
+const static size_t JOB_STEAL_CHUNK_SIZE = 1000;
+const static size_t JOB_STEAL_CHUNK_COST = 20000;
+
+// Work-stealing scheduler for the geometry check jobs. Each worker has its
+// own deque of job chunks, every batch is added for a specific worker. A
+// worker takes the oldest chunk of its own deque, and if that is empty,
+// steals the newest chunk of another worker.
+//
+// Jobs are weighed by their estimated cost, as given by C. Chunks, the
+// queue bound and size() are in units of this cost. Every job has a sweep
+// position, as given by P. When a worker takes a chunk, the minimum position
+// of its jobs is published for the worker before the chunk leaves its deque,
+// so minPos() is a lower bound for the positions of all jobs which are
+// queued or in progress, including stolen ones.
+//
+// done() signals that no more jobs will come, get() then returns an empty
+// chunk once all queued jobs have been handed out.
+template <typename T, typename C, typename P>
+class JobScheduler {
+ public:
+  JobScheduler(size_t numWorkers, size_t maxCost)
+      : _deques(std::max<size_t>(1, numWorkers)),
+        _pos(_deques.size()),
+        _maxCost(maxCost) {
+    for (auto& pos : _pos) pos = std::numeric_limits<int32_t>::max();
+  }
+
+  // add a batch to the deque of worker w
+  void add(std::vector<T>&& batch, size_t w) {
+    if (batch.empty()) return;
+
+    {
+      std::unique_lock<std::mutex> lock(_mtx);
+      _hasCap.wait(lock, [&]() { return _pending < _maxCost; });
+    }
+
+    Deque& d = _deques[w % _deques.size()];
+
+    std::vector<Chunk> chunks;
+    size_t total = 0;
+
+    for (auto& job : batch) {
+      size_t cost = C()(job);
+      if (chunks.empty() ||
+          chunks.back().jobs.size() >= JOB_STEAL_CHUNK_SIZE ||
+          chunks.back().cost >= JOB_STEAL_CHUNK_COST) {
+        chunks.push_back({{}, 0, std::numeric_limits<int32_t>::max()});
+      }
+      chunks.back().pos = std::min(chunks.back().pos, P()(job));
+      chunks.back().jobs.push_back(std::move(job));
+      chunks.back().cost += cost;
+      total += cost;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(d.mtx);
+
+      // count the jobs before they become visible, so _pending never drops
+      // below the cost of the queued jobs
+      _pending += total;
+
+      for (auto& chunk : chunks) d.chunks.push_back(std::move(chunk));
+    }
+
+    { std::unique_lock<std::mutex> lock(_mtx); }
+    _hasWork.notify_all();
+  }
+
+  // no more batches will be added
+  void done() {
+    {
+      std::unique_lock<std::mutex> lock(_mtx);
+      _done = true;
+    }
+    _hasWork.notify_all();
+  }
+
+  // next chunk of jobs for worker w, empty if all work is done
+  std::vector<T> get(size_t w) {
+    // the jobs of the previous chunk are done
+    _pos[w % _pos.size()] = std::numeric_limits<int32_t>::max();
+
+    while (true) {
+      for (size_t i = 0; i < _deques.size(); i++) {
+        Deque& d = _deques[(w + i) % _deques.size()];
+        std::unique_lock<std::mutex> lock(d.mtx);
+        if (d.chunks.empty()) continue;
+
+        Chunk chunk;
+        if (i == 0) {
+          chunk = std::move(d.chunks.front());
+          d.chunks.pop_front();
+        } else {
+          chunk = std::move(d.chunks.back());
+          d.chunks.pop_back();
+        }
+
+        // still under the deque lock, see minPos()
+        _pos[w % _pos.size()] = chunk.pos;
+
+        _pending -= chunk.cost;
+        lock.unlock();
+
+        { std::unique_lock<std::mutex> lock(_mtx); }
+        _hasCap.notify_all();
+        return std::move(chunk.jobs);
+      }
+
+      std::unique_lock<std::mutex> lock(_mtx);
+      if (_done && _pending == 0) return {};
+      _hasWork.wait(lock, [&]() { return _pending > 0 || _done; });
+      if (_done && _pending == 0) return {};
+    }
+  }
+
+  // lower bound for the positions of all queued jobs and of the jobs the
+  // workers are processing, INT32_MAX if there are none. Jobs added
+  // concurrently may not be covered
+  int32_t minPos() const {
+    int32_t ret = std::numeric_limits<int32_t>::max();
+
+    // the queued chunks are checked first: a chunk taken meanwhile has
+    // already been published for its worker, which is checked below
+    for (const auto& d : _deques) {
+      std::unique_lock<std::mutex> lock(d.mtx);
+      for (const auto& chunk : d.chunks) ret = std::min(ret, chunk.pos);
+    }
+
+    for (const auto& pos : _pos) ret = std::min<int32_t>(ret, pos);
+
+    return ret;
+  }
+
+  // estimated cost of the queued jobs
+  size_t size() const { return _pending; }
+
+  void reset() {
+    for (auto& d : _deques) {
+      std::unique_lock<std::mutex> lock(d.mtx);
+      d.chunks.clear();
+    }
+    std::unique_lock<std::mutex> lock(_mtx);
+    _pending = 0;
+    _done = false;
+    for (auto& pos : _pos) pos = std::numeric_limits<int32_t>::max();
+  }
+
+ private:
+  struct Chunk {
+    std::vector<T> jobs;
+    size_t cost;
+    int32_t pos;
+  };
+
+  struct Deque {
+    mutable std::mutex mtx;
+    std::deque<Chunk> chunks;
+  };
+
+  std::vector<Deque> _deques;
+  // minimum position of the chunk each worker is processing
+  std::vector<std::atomic<int32_t>> _pos;
+  size_t _maxCost;
+
+  std::atomic<size_t> _pending{0};
+  bool _done = false;
+
+  std::mutex _mtx;
+  std::condition_variable _hasWork;
+  std::condition_variable _hasCap;
+};
+}  // namespace sj
+
+#endif
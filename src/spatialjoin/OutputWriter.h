@@ -85,6 +85,9 @@ class OutputWriter {
 
   OutMode getOutMode() const { return _outMode; }
 
+  // only change the prefix while no relations are written
+  void setPrefix(const std::string& prefix) { _prefix = prefix; }
+
   void flushOutputFiles() {
     if (_outMode == COUT) {
       for (size_t i = 0; i < _numThreads + 1; i++) {
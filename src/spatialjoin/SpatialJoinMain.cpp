@@ -2,7 +2,9 @@
 // Chair of Algorithms and Data Structures.
 // Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
 
+#include <fstream>
 #include <iostream>
+#include <unordered_set>
 
 #include "BoxIds.h"
 #include "OutputWriter.h"
@@ -34,7 +36,8 @@ static const char* AUTHORS = "Patrick Brosi <brosi@informatik.uni-freiburg.de>";
 
 static const size_t NUM_THREADS = std::thread::hardware_concurrency();
 static const size_t DEFAULT_CACHE_SIZE = 1000 * 1000 * 1000;
-static const size_t DEFAULT_CACHE_NUM_ELEMENTS = 10000;
+static const size_t DEFAULT_CACHE_NUM_ELEMENTS = 100000;
+static const size_t DEFAULT_SORT_MEM_BUDGET = 1000 * 1000 * 1000;
 
 // _____________________________________________________________________________
 void printHelp(int argc, char** argv) {
@@ -94,6 +97,10 @@ void printHelp(int argc, char** argv) {
       << "disable diagonal bounding-box based pre-filter\n"
       << std::setw(42) << "  --no-fast-sweep-skip"
       << "disable fast sweep skip using binary search\n"
+      << std::setw(42) << "  --hash-duplicates"
+      << "remove duplicate geometries at parse time\n"
+      << std::setw(42) << "  --evict-retired"
+      << "evict swept geometries from the caches once checked\n"
       << std::setw(42) << "  --use-inner-outer"
       << "(experimental) use inner/outer geometries\n\n"
       << std::setfill(' ') << std::left << "Misc:\n"
@@ -102,17 +109,52 @@ void printHelp(int argc, char** argv) {
       << "number of threads for geometric computation\n"
       << std::setw(42)
       << "  --num-caches (default: " + std::to_string(NUM_THREADS) + ")"
-      << "number of geometry caches (if < --num-threads, syncing)\n"
+      << "number of geometry file readers (if < --num-threads,\n"
+      << std::setw(42) << " " << "syncing)\n"
+      << std::setw(42) << "  --sweep-stripes (default: 1)"
+      << "number of x-stripes swept in parallel, 1 = serial sweep\n"
+      << std::setw(42) << "  --sweep-axis (default: 'auto')"
+      << "axis to sweep along, 'x', 'y' or 'auto' to choose the\n"
+      << std::setw(42) << " " << "axis with the smaller expected active set\n"
+      << std::setw(42)
+      << "  --sort-mem-budget (default: " +
+             std::to_string(DEFAULT_SORT_MEM_BUDGET) + ")"
+      << "max. size in bytes of events sorted in memory, larger\n"
+      << std::setw(42) << " " << "event sets are spilled in sorted runs of\n"
+      << std::setw(42) << " " << "this size during parsing\n"
+      << std::setw(42) << "  --single-events"
+      << "only store IN events, restore OUT events during sweep\n"
+      << std::setw(42) << "  --prefetch"
+      << "load geometries of queued checks in the background\n"
+      << std::setw(42) << "  --pipeline-sweep"
+      << "start the sweep while the spilled event runs are still\n"
+      << std::setw(42) << " " << "being merged (single stripe only)\n"
+      << std::setw(42) << "  --prepare"
+      << "store the parsed and sorted input in the given directory\n"
+      << std::setw(42) << "  --load"
+      << "skip parsing and sorting, load the input from a directory\n"
+      << std::setw(42) << " " << "written with --prepare\n"
+      << std::setw(42) << "  --delta"
+      << "join the input (added and modified geometries) against\n"
+      << std::setw(42) << " " << "a directory written with --prepare, output\n"
+      << std::setw(42) << " " << "relations to retract (prefix '-') and to\n"
+      << std::setw(42) << " " << "add (prefix '+')\n"
+      << std::setw(42) << "  --deleted"
+      << "file with the IDs of deleted geometries for --delta,\n"
+      << std::setw(42) << " " << "one per line\n"
       << std::setw(42)
       << "  --cache-max-size (default: " + std::to_string(DEFAULT_CACHE_SIZE) +
              ")"
-      << "maximum approx. size in bytes of cache per type and\n"
-      << std::setw(42) << " " << "thread, 0 = unlimited\n"
+      << "maximum approx. size in bytes of cache per type, shared\n"
+      << std::setw(42) << " " << "by all threads, 0 = unlimited\n"
       << std::setw(42)
       << "  --cache-max-elements (default: " +
              std::to_string(DEFAULT_CACHE_NUM_ELEMENTS) + ")"
-      << "maximum number of elements per cache, type and thread,\n"
-      << std::setw(42) << " " << "0 = unlimited\n"
+      << "maximum number of elements per cache and type, shared\n"
+      << std::setw(42) << " " << "by all threads, 0 = unlimited\n"
+      << std::setw(42) << "  --cache-policy (default: 'lru')"
+      << "eviction policy of the geometry caches, 'lru' or\n"
+      << std::setw(42) << " " << "'s3fifo' (scan-resistant)\n"
       << std::setw(42) << "  --no-geometry-checks"
       << "do not compute geometric relations, only report number of\n"
       << std::setw(42) << " "
@@ -153,6 +195,8 @@ int main(int argc, char** argv) {
   bool useDiagBox = true;
   bool useFastSweepSkip = true;
   bool useInnerOuter = false;
+  bool hashDuplicates = false;
+  bool evictRetired = false;
   bool noGeometryChecks = false;
   bool computeDE9IM = false;
 
@@ -163,6 +207,17 @@ int main(int argc, char** argv) {
   size_t numCaches = NUM_THREADS;
   size_t geomCacheMaxSizeBytes = DEFAULT_CACHE_SIZE;
   size_t geomCacheMaxNumElements = DEFAULT_CACHE_NUM_ELEMENTS;
+  size_t numSweepStripes = 1;
+  std::string sweepAxis = "auto";
+  std::string cachePolicy = "lru";
+  size_t sortMemBudget = DEFAULT_SORT_MEM_BUDGET;
+  bool singleEvents = false;
+  bool prefetch = false;
+  bool pipelineSweep = false;
+  std::string prepareDir;
+  std::string loadDir;
+  std::string deltaDir;
+  std::string deletedFile;
 
   std::vector<std::string> inputFiles;
 
@@ -208,6 +263,22 @@ int main(int argc, char** argv) {
           state = 15;
         } else if (cur == "--cache-max-elements") {
           state = 16;
+        } else if (cur == "--sweep-stripes") {
+          state = 17;
+        } else if (cur == "--sort-mem-budget") {
+          state = 18;
+        } else if (cur == "--prepare") {
+          state = 19;
+        } else if (cur == "--load") {
+          state = 20;
+        } else if (cur == "--delta") {
+          state = 21;
+        } else if (cur == "--deleted") {
+          state = 22;
+        } else if (cur == "--sweep-axis") {
+          state = 23;
+        } else if (cur == "--cache-policy") {
+          state = 24;
         } else if (cur == "--de9im") {
           computeDE9IM = true;
         } else if (cur == "--no-box-ids") {
@@ -222,8 +293,18 @@ int main(int argc, char** argv) {
           noGeometryChecks = true;
         } else if (cur == "--no-fast-sweep-skip") {
           useFastSweepSkip = false;
+        } else if (cur == "--hash-duplicates") {
+          hashDuplicates = true;
+        } else if (cur == "--evict-retired") {
+          evictRetired = true;
         } else if (cur == "--use-inner-outer") {
           useInnerOuter = true;
+        } else if (cur == "--single-events") {
+          singleEvents = true;
+        } else if (cur == "--prefetch") {
+          prefetch = true;
+        } else if (cur == "--pipeline-sweep") {
+          pipelineSweep = true;
         } else if (cur == "--stats") {
           printStats = true;
         } else if (cur == "--verbose" || cur == "-v") {
@@ -296,6 +377,38 @@ int main(int argc, char** argv) {
         std::stringstream(cur) >> geomCacheMaxNumElements;
         state = 0;
         break;
+      case 17:
+        numSweepStripes = atoi(cur.c_str());
+        state = 0;
+        break;
+      case 18:
+        std::stringstream(cur) >> sortMemBudget;
+        state = 0;
+        break;
+      case 19:
+        prepareDir = cur;
+        state = 0;
+        break;
+      case 20:
+        loadDir = cur;
+        state = 0;
+        break;
+      case 21:
+        deltaDir = cur;
+        state = 0;
+        break;
+      case 22:
+        deletedFile = cur;
+        state = 0;
+        break;
+      case 23:
+        sweepAxis = cur;
+        state = 0;
+        break;
+      case 24:
+        cachePolicy = cur;
+        state = 0;
+        break;
     }
   }
 
@@ -339,7 +452,44 @@ int main(int argc, char** argv) {
                             {},
                             {},
                             {},
-                            {}};
+                            {},
+                            numSweepStripes,
+                            sortMemBudget,
+                            singleEvents};
+
+  if (!deltaDir.empty() && (!loadDir.empty() || !prepareDir.empty())) {
+    std::cerr << "--delta cannot be combined with --load or --prepare."
+              << std::endl;
+    exit(1);
+  }
+
+  sweeperCfg.recordXRanges = !prepareDir.empty();
+  sweeperCfg.hashDuplicates = hashDuplicates;
+  sweeperCfg.evictRetired = evictRetired;
+  sweeperCfg.prefetch = prefetch;
+  sweeperCfg.pipelineSweep = pipelineSweep;
+
+  if (sweepAxis == "x") {
+    sweeperCfg.sweepAxis = sj::SWEEP_X;
+  } else if (sweepAxis == "y") {
+    sweeperCfg.sweepAxis = sj::SWEEP_Y;
+  } else if (sweepAxis == "auto") {
+    sweeperCfg.sweepAxis = sj::SWEEP_AUTO;
+  } else {
+    std::cerr << "Unknown sweep axis '" << sweepAxis
+              << "', expected 'x', 'y' or 'auto'." << std::endl;
+    exit(1);
+  }
+
+  if (cachePolicy == "lru") {
+    sweeperCfg.geomCachePolicy = sj::CACHE_LRU;
+  } else if (cachePolicy == "s3fifo") {
+    sweeperCfg.geomCachePolicy = sj::CACHE_S3FIFO;
+  } else {
+    std::cerr << "Unknown cache policy '" << cachePolicy
+              << "', expected 'lru' or 's3fifo'." << std::endl;
+    exit(1);
+  }
 
   if (printStats)
     sweeperCfg.statsCb = [](const std::string& s) { std::cerr << s; };
@@ -351,96 +501,143 @@ int main(int argc, char** argv) {
 
   Sweeper sweeper(sweeperCfg, cache);
 
-  sweeper.log("Parsing input geometries...");
-  auto ts = TIME();
-
-  sj::WKTParser parser(&sweeper, NUM_THREADS);
+  // the added and modified geometries are parsed on top of the delta base
+  if (!deltaDir.empty()) sweeper.loadPrepared(deltaDir, true);
 
-  if (!inputFiles.empty()) {
-    if (inputFiles.size() > 2) {
-      std::cerr << "Either 1 input files (for self join), or 2 input files "
-                   "(for non-self join) can be provided."
+  if (!loadDir.empty()) {
+    if (!inputFiles.empty()) {
+      std::cerr << "No input files can be given together with --load."
                 << std::endl;
       exit(1);
     }
-    for (size_t i = 0; i < inputFiles.size(); i++) {
-      if (util::endsWith(inputFiles[i], ".bz2")) {
+    sweeper.loadPrepared(loadDir);
+  } else {
+    sweeper.log("Parsing input geometries...");
+    auto ts = TIME();
+
+    sj::WKTParser parser(&sweeper, NUM_THREADS);
+
+    if (!inputFiles.empty()) {
+      if (inputFiles.size() > 2) {
+        std::cerr << "Either 1 input files (for self join), or 2 input files "
+                     "(for non-self join) can be provided."
+                  << std::endl;
+        exit(1);
+      }
+      for (size_t i = 0; i < inputFiles.size(); i++) {
+        if (util::endsWith(inputFiles[i], ".bz2")) {
 #ifndef SPATIALJOIN_NO_BZIP2
-        auto fh = fopen(inputFiles[i].c_str(), "r");
-        if (!fh) {
-          std::cerr << "Could not open input file " << inputFiles[i]
-                    << std::endl;
-          exit(1);
-        }
-        int err;
-        BZFILE* f = BZ2_bzReadOpen(&err, fh, 0, 0, NULL, 0);
-        if (!f || err != BZ_OK) {
+          auto fh = fopen(inputFiles[i].c_str(), "r");
+          if (!fh) {
+            std::cerr << "Could not open input file " << inputFiles[i]
+                      << std::endl;
+            exit(1);
+          }
+          int err;
+          BZFILE* f = BZ2_bzReadOpen(&err, fh, 0, 0, NULL, 0);
+          if (!f || err != BZ_OK) {
+            std::cerr << "Could not open input file " << inputFiles[i]
+                      << std::endl;
+            exit(1);
+          }
+          while ((len = util::bz2readAll(f, buf, CACHE_SIZE)) > 0) {
+            parser.parse(reinterpret_cast<char*>(buf), len,
+                         i != 0 || !deltaDir.empty());
+          }
+
+          BZ2_bzReadClose(&err, f);
+          fclose(fh);
+#else
           std::cerr << "Could not open input file " << inputFiles[i]
+                    << ", spatialjoin was compiled without BZip2 support"
                     << std::endl;
           exit(1);
-        }
-        while ((len = util::bz2readAll(f, buf, CACHE_SIZE)) > 0) {
-          parser.parse(reinterpret_cast<char*>(buf), len, i != 0);
-        }
-
-        BZ2_bzReadClose(&err, f);
-        fclose(fh);
-#else
-        std::cerr << "Could not open input file " << inputFiles[i]
-                  << ", spatialjoin was compiled without BZip2 support"
-                  << std::endl;
-        exit(1);
 #endif
-      } else if (util::endsWith(inputFiles[i], ".gz")) {
+        } else if (util::endsWith(inputFiles[i], ".gz")) {
 #ifndef SPATIALJOIN_NO_ZLIB
-        gzFile f = gzopen(inputFiles[i].c_str(), "r");
-        if (f == Z_NULL) {
+          gzFile f = gzopen(inputFiles[i].c_str(), "r");
+          if (f == Z_NULL) {
+            std::cerr << "Could not open input file " << inputFiles[i]
+                      << std::endl;
+            exit(1);
+          }
+          while ((len = util::zreadAll(f, buf, CACHE_SIZE)) > 0) {
+            parser.parse(reinterpret_cast<char*>(buf), len,
+                         i != 0 || !deltaDir.empty());
+          }
+
+          gzclose(f);
+#else
           std::cerr << "Could not open input file " << inputFiles[i]
+                    << ", spatialjoin was compiled without gzip support"
                     << std::endl;
           exit(1);
-        }
-        while ((len = util::zreadAll(f, buf, CACHE_SIZE)) > 0) {
-          parser.parse(reinterpret_cast<char*>(buf), len, i != 0);
-        }
-
-        gzclose(f);
-#else
-        std::cerr << "Could not open input file " << inputFiles[i]
-                  << ", spatialjoin was compiled without gzip support"
-                  << std::endl;
-        exit(1);
 #endif
-      } else {
-        int f = open(inputFiles[i].c_str(), O_RDONLY);
+        } else {
+          int f = open(inputFiles[i].c_str(), O_RDONLY);
 
-        if (f < 0) {
-          std::cerr << "Could not open input file " << inputFiles[i]
-                    << std::endl;
-          exit(1);
-        }
+          if (f < 0) {
+            std::cerr << "Could not open input file " << inputFiles[i]
+                      << std::endl;
+            exit(1);
+          }
 
-        while ((len = util::readAll(f, buf, CACHE_SIZE)) > 0) {
-          parser.parse(reinterpret_cast<char*>(buf), len, i != 0);
-        }
+          while ((len = util::readAll(f, buf, CACHE_SIZE)) > 0) {
+            parser.parse(reinterpret_cast<char*>(buf), len,
+                         i != 0 || !deltaDir.empty());
+          }
 
-        close(f);
+          close(f);
+        }
+      }
+    } else {
+      while ((len = util::readAll(0, buf, CACHE_SIZE)) > 0) {
+        parser.parse(reinterpret_cast<char*>(buf), len, !deltaDir.empty());
       }
     }
-  } else {
-    while ((len = util::readAll(0, buf, CACHE_SIZE)) > 0) {
-      parser.parse(reinterpret_cast<char*>(buf), len, 0);
-    }
-  }
 
-  parser.done();
+    parser.done();
 
-  sweeper.log("Done parsing (" + std::to_string(TOOK(ts) / 1000000000.0) +
-              "s).");
-  sweeper.flush();
+    sweeper.log("Done parsing (" + std::to_string(TOOK(ts) / 1000000000.0) +
+                "s).");
+    sweeper.flush();
+
+    if (!prepareDir.empty()) sweeper.storePrepared(prepareDir);
+  }
 
   sweeper.log("Sweeping...");
-  ts = TIME();
-  sweeper.sweep();
+  auto ts = TIME();
+
+  if (!deltaDir.empty()) {
+    auto changed = sweeper.deltaIds();
+
+    if (!deletedFile.empty()) {
+      std::ifstream deleted(deletedFile);
+      if (!deleted.good()) {
+        std::cerr << "Could not open deleted IDs file " << deletedFile
+                  << std::endl;
+        exit(1);
+      }
+      std::string id;
+      while (std::getline(deleted, id)) {
+        if (!id.empty()) changed.insert(sj::idEnhance(id));
+      }
+    }
+
+    {
+      // relations of the old versions of all changed geometries
+      Sweeper retracted(sweeperCfg, cache);
+      retracted.loadPrepared(deltaDir);
+      outWriter.setPrefix("-" + prefix);
+      retracted.sweepDeltaRetracted(changed);
+    }
+
+    outWriter.setPrefix("+" + prefix);
+    sweeper.sweepDeltaAdded(changed);
+  } else {
+    sweeper.sweep();
+  }
+
   sweeper.log("done (" + std::to_string(TOOK(ts) / 1000000000.0) + "s).");
 
   delete[] buf;
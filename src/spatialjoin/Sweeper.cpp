@@ -16,14 +16,18 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <memory>
 #include <set>
 #include <sstream>
 
 #include "BoxIds.h"
+#include "EventReader.h"
+#include "EventSort.h"
 #include "InnerOuter.h"
 #include "Sweeper.h"
 #include "util/Misc.h"
-#include "util/geo/IntervalIdx.h"
 #include "util/log/Log.h"
 
 using sj::GeomCheckRes;
@@ -37,7 +41,6 @@ using sj::boxids::packBoxIds;
 using sj::innerouter::Mode;
 using util::preadAll;
 using util::pwriteAll;
-using util::readAll;
 using util::writeAll;
 using util::geo::area;
 using util::geo::DE9IM;
@@ -67,6 +70,31 @@ const static size_t OBB_MIN_SIZE = 100;
 const static double sin45 = 1.0 / sqrt(2);
 const static double cos45 = 1.0 / sqrt(2);
 
+// _____________________________________________________________________________
+static void writeSize(std::ostream& out, size_t v) {
+  out.write(reinterpret_cast<const char*>(&v), sizeof(size_t));
+}
+
+// _____________________________________________________________________________
+static void writeString(std::ostream& out, const std::string& s) {
+  writeSize(out, s.size());
+  out.write(s.c_str(), s.size());
+}
+
+// _____________________________________________________________________________
+static size_t readSize(std::istream& in) {
+  size_t v = 0;
+  in.read(reinterpret_cast<char*>(&v), sizeof(size_t));
+  return v;
+}
+
+// _____________________________________________________________________________
+static std::string readString(std::istream& in) {
+  std::string s(readSize(in), 0);
+  if (s.size()) in.read(&s[0], s.size());
+  return s;
+}
+
 // _____________________________________________________________________________
 I32Box Sweeper::add(const I32MultiPolygon& a, const std::string& gid, bool side,
                     WriteBatch& batch) const {
@@ -174,6 +202,8 @@ void Sweeper::add(const std::string& parentR, const util::geo::I32Box& box,
 
   boxl.val = box.getLowerLeft().getX();
   boxr.val = box.getUpperRight().getX();
+  boxl.loY = boxr.loY = box.getLowerLeft().getY();
+  boxl.upY = boxr.upY = box.getUpperRight().getY();
 
   batch.refs.push_back({parent, gid, boxl, boxr, subid});
 }
@@ -215,6 +245,7 @@ I32Box Sweeper::add(const I32Polygon& poly, const std::string& gidR,
 
   cur.subid = subid;
   cur.gid = gid;
+  if (_cfg.hashDuplicates) cur.hash = geomHash(poly, &cur.hashBytes);
 
   if (poly.getInners().size() == 0 && subid == 0 && gid.size() < 8 &&
       (!_cfg.useBoxIds || boxIds.front().first == 1) &&
@@ -400,6 +431,7 @@ I32Box Sweeper::add(const I32Line& line, const std::string& gidR, size_t subid,
 
   cur.subid = subid;
   cur.gid = gid;
+  if (_cfg.hashDuplicates) cur.hash = geomHash(line, &cur.hashBytes);
 
   if (line.size() == 2 && (!_cfg.useBoxIds || boxIds.front().first == 1) &&
       subid == 0) {
@@ -549,6 +581,12 @@ I32Box Sweeper::add(const I32Point& point, const std::string& gidR,
 
   cur.gid = gid;
 
+  // self checks of points are only equivalent to point/point checks for
+  // single points
+  if (_cfg.hashDuplicates && subid == 0) {
+    cur.hash = geomHash(point, &cur.hashBytes);
+  }
+
   // check if we can fold the gid into the offset id, because the gid is all
   // we store in the cache for points
   if (subid == 0 && gid.size() < 8) {
@@ -569,6 +607,137 @@ I32Box Sweeper::add(const I32Point& point, const std::string& gidR,
 
 // _____________________________________________________________________________
 void Sweeper::addBatch(WriteBatch& cands) {
+  if (!_axisChosen) {
+    std::unique_lock<std::mutex> lock(_axisMtx);
+    if (!_axisChosen) {
+      sampleAxis(cands);
+      _axisSample.push_back(std::move(cands));
+      if (_axisSampleSize >= AXIS_SAMPLE_SIZE) chooseAxis();
+      return;
+    }
+  }
+
+  writeBatch(cands);
+}
+
+// _____________________________________________________________________________
+void Sweeper::sampleAxis(const WriteBatch& cands) {
+  for (const auto* list :
+       {&cands.foldedPoints, &cands.points, &cands.foldedSimpleLines,
+        &cands.foldedBoxAreas, &cands.simpleLines, &cands.lines,
+        &cands.simpleAreas, &cands.areas}) {
+    for (const auto& cand : *list) {
+      _axisSampleW += int64_t(cand.boxvalOut.val) - cand.boxvalIn.val;
+      _axisSampleH += int64_t(cand.boxvalIn.upY) - cand.boxvalIn.loY;
+      _axisSampleBox = util::geo::extendBox(
+          I32Box({cand.boxvalIn.val, cand.boxvalIn.loY},
+                 {cand.boxvalOut.val, cand.boxvalIn.upY}),
+          _axisSampleBox);
+      _axisSampleSize++;
+    }
+  }
+}
+
+// _____________________________________________________________________________
+void Sweeper::chooseAxis() {
+  // a geometry is active at a random sweep position with a probability of
+  // its extent along the sweep axis divided by the extent of the sample
+  double w = int64_t(_axisSampleBox.getUpperRight().getX()) -
+             _axisSampleBox.getLowerLeft().getX();
+  double h = int64_t(_axisSampleBox.getUpperRight().getY()) -
+             _axisSampleBox.getLowerLeft().getY();
+
+  if (_axisSampleSize > 0 && w > 0 && h > 0) {
+    double activeX = _axisSampleW / w;
+    double activeY = _axisSampleH / h;
+
+    _transposed = activeY * AXIS_SWITCH_FACTOR < activeX;
+
+    std::stringstream ss;
+    ss << "Sweeping along " << (_transposed ? "y" : "x") << " (expected "
+       << activeX << " active geometries along x, " << activeY
+       << " along y, in a sample of " << _axisSampleSize << ")";
+    log(ss.str());
+  }
+
+  for (auto& batch : _axisSample) writeBatch(batch);
+
+  _axisSample = {};
+  _axisChosen = true;
+}
+
+// _____________________________________________________________________________
+void Sweeper::transpose(WriteCand* cand, bool ref) const {
+  BoxVal& in = cand->boxvalIn;
+  BoxVal& out = cand->boxvalOut;
+
+  int32_t loX = in.val;
+  int32_t upX = out.val;
+
+  in.val = in.loY;
+  out.val = in.upY;
+  in.loY = out.loY = loX;
+  in.upY = out.upY = upX;
+
+  // references only carry their box
+  if (ref) return;
+
+  I32Point a(in.point.getY(), in.point.getX());
+  I32Point b(out.point.getY(), out.point.getX());
+
+  if (isSimpleLine(in.type)) {
+    // the IN event holds the end point with the larger sweep coordinate, the
+    // other one is restored from the box
+    if (a.getX() < b.getX()) std::swap(a, b);
+  } else if (!isPoint(in.type) && in.type != FOLDED_BOX_POLYGON) {
+    // for polygons and lines, the point holds the number of anchor points
+    return;
+  }
+
+  in.point = a;
+  out.point = b;
+}
+
+// _____________________________________________________________________________
+void Sweeper::untranspose(JobVal* jv) const {
+  if (!isPoint(jv->type) && !isSimpleLine(jv->type) &&
+      jv->type != FOLDED_BOX_POLYGON)
+    return;
+
+  jv->point = I32Point(jv->point.getY(), jv->point.getX());
+  jv->point2 = I32Point(jv->point2.getY(), jv->point2.getX());
+
+  // like untransposed events, simple lines start at the end point with the
+  // larger x coordinate
+  if (isSimpleLine(jv->type) && jv->point.getX() < jv->point2.getX()) {
+    std::swap(jv->point, jv->point2);
+  }
+}
+
+// _____________________________________________________________________________
+void Sweeper::writeBatch(WriteBatch& cands) {
+  if (_transposed) {
+    for (auto* list :
+         {&cands.foldedPoints, &cands.points, &cands.foldedSimpleLines,
+          &cands.foldedBoxAreas, &cands.simpleLines, &cands.lines,
+          &cands.simpleAreas, &cands.areas}) {
+      for (auto& cand : *list) transpose(&cand, false);
+    }
+    for (auto& cand : cands.refs) transpose(&cand, true);
+  }
+
+  if (_cfg.hashDuplicates) {
+    std::unique_lock<std::mutex> lock(_sweepEventWriteMtx);
+    removeHashDuplicates(&cands.foldedPoints, SELF_CHECK_POINT);
+    removeHashDuplicates(&cands.points, SELF_CHECK_POINT);
+    removeHashDuplicates(&cands.foldedSimpleLines, SELF_CHECK_LINE);
+    removeHashDuplicates(&cands.simpleLines, SELF_CHECK_LINE);
+    removeHashDuplicates(&cands.lines, SELF_CHECK_LINE);
+    removeHashDuplicates(&cands.foldedBoxAreas, SELF_CHECK_AREA);
+    removeHashDuplicates(&cands.simpleAreas, SELF_CHECK_AREA);
+    removeHashDuplicates(&cands.areas, SELF_CHECK_AREA);
+  }
+
   {
     for (auto& cand : cands.foldedPoints) {
       if (cand.boxvalIn.side) _numSides = 2;
@@ -689,72 +858,203 @@ void Sweeper::addBatch(WriteBatch& cands) {
   {
     std::unique_lock<std::mutex> lock(_sweepEventWriteMtx);
     for (const auto& cand : cands.foldedPoints) {
-      diskAdd(cand.boxvalIn);
-      diskAdd(cand.boxvalOut);
-      if (_curSweepId / 2 % 1000000 == 0)
-        log("@ " + std::to_string(_curSweepId / 2));
+      diskAdd(cand.boxvalIn, cand.boxvalOut);
+      if (_curSweepId / eventsPerGeom() % 1000000 == 0)
+        log("@ " + std::to_string(_curSweepId / eventsPerGeom()));
     }
     for (const auto& cand : cands.points) {
-      diskAdd(cand.boxvalIn);
-      diskAdd(cand.boxvalOut);
-      if (_curSweepId / 2 % 1000000 == 0)
-        log("@ " + std::to_string(_curSweepId / 2));
+      diskAdd(cand.boxvalIn, cand.boxvalOut);
+      if (_curSweepId / eventsPerGeom() % 1000000 == 0)
+        log("@ " + std::to_string(_curSweepId / eventsPerGeom()));
     }
     for (const auto& cand : cands.foldedSimpleLines) {
-      diskAdd(cand.boxvalIn);
-      diskAdd(cand.boxvalOut);
-      if (_curSweepId / 2 % 1000000 == 0)
-        log("@ " + std::to_string(_curSweepId / 2));
+      diskAdd(cand.boxvalIn, cand.boxvalOut);
+      if (_curSweepId / eventsPerGeom() % 1000000 == 0)
+        log("@ " + std::to_string(_curSweepId / eventsPerGeom()));
     }
     for (const auto& cand : cands.foldedBoxAreas) {
-      diskAdd(cand.boxvalIn);
-      diskAdd(cand.boxvalOut);
-      if (_curSweepId / 2 % 1000000 == 0)
-        log("@ " + std::to_string(_curSweepId / 2));
+      diskAdd(cand.boxvalIn, cand.boxvalOut);
+      if (_curSweepId / eventsPerGeom() % 1000000 == 0)
+        log("@ " + std::to_string(_curSweepId / eventsPerGeom()));
     }
     for (const auto& cand : cands.simpleLines) {
-      diskAdd(cand.boxvalIn);
-      diskAdd(cand.boxvalOut);
-      if (_curSweepId / 2 % 1000000 == 0)
-        log("@ " + std::to_string(_curSweepId / 2));
+      diskAdd(cand.boxvalIn, cand.boxvalOut);
+      if (_curSweepId / eventsPerGeom() % 1000000 == 0)
+        log("@ " + std::to_string(_curSweepId / eventsPerGeom()));
     }
     for (const auto& cand : cands.lines) {
-      diskAdd(cand.boxvalIn);
-      diskAdd(cand.boxvalOut);
-      if (_curSweepId / 2 % 1000000 == 0)
-        log("@ " + std::to_string(_curSweepId / 2));
+      diskAdd(cand.boxvalIn, cand.boxvalOut);
+      if (_curSweepId / eventsPerGeom() % 1000000 == 0)
+        log("@ " + std::to_string(_curSweepId / eventsPerGeom()));
     }
     for (const auto& cand : cands.simpleAreas) {
-      diskAdd(cand.boxvalIn);
-      diskAdd(cand.boxvalOut);
-      if (_curSweepId / 2 % 1000000 == 0)
-        log("@ " + std::to_string(_curSweepId / 2));
+      diskAdd(cand.boxvalIn, cand.boxvalOut);
+      if (_curSweepId / eventsPerGeom() % 1000000 == 0)
+        log("@ " + std::to_string(_curSweepId / eventsPerGeom()));
     }
     for (const auto& cand : cands.areas) {
-      diskAdd(cand.boxvalIn);
-      diskAdd(cand.boxvalOut);
-      if (_curSweepId / 2 % 1000000 == 0)
-        log("@ " + std::to_string(_curSweepId / 2));
+      diskAdd(cand.boxvalIn, cand.boxvalOut);
+      if (_curSweepId / eventsPerGeom() % 1000000 == 0)
+        log("@ " + std::to_string(_curSweepId / eventsPerGeom()));
     }
     for (const auto& cand : cands.refs) {
       _refs[cand.raw][0][cand.gid] = cand.subid;
       _selfCheckBounds[cand.raw] = util::geo::getBoundingBox(
           I32Point{cand.boxvalIn.val, cand.boxvalIn.loY});
-      if (_curSweepId / 2 % 1000000 == 0)
-        log("@ " + std::to_string(_curSweepId / 2));
+      if (_curSweepId / eventsPerGeom() % 1000000 == 0)
+        log("@ " + std::to_string(_curSweepId / eventsPerGeom()));
+    }
+
+    if (_xRangesF.is_open() || _deltaBase) {
+      for (const auto* list :
+           {&cands.foldedPoints, &cands.points, &cands.foldedSimpleLines,
+            &cands.foldedBoxAreas, &cands.simpleLines, &cands.lines,
+            &cands.simpleAreas, &cands.areas}) {
+        for (const auto& cand : *list) recordXRange(cand, false);
+      }
+      for (const auto& cand : cands.refs) recordXRange(cand, true);
+    }
+  }
+}
+
+// _____________________________________________________________________________
+void Sweeper::removeHashDuplicates(std::vector<WriteCand>* cands,
+                                   GeomType type) {
+  size_t j = 0;
+  for (size_t i = 0; i < cands->size(); i++) {
+    auto& cand = (*cands)[i];
+    bool side = cand.boxvalIn.side;
+
+    if (cand.hash.isNull()) {
+      if (i != j) (*cands)[j] = std::move(cand);
+      j++;
+      continue;
+    }
+
+    auto ins = _geomHashes[side].insert({cand.hash, _hashFileSize});
+    if (ins.second) writeHashParent(cand);
+
+    // parts of the same multi geometry (or repeated ids) must not reference
+    // each other, and equal hashes of different geometries are kept apart
+    std::pair<std::string, size_t> parent;
+    if (ins.second || !readHashParent(ins.first->second, cand, &parent)) {
+      if (i != j) (*cands)[j] = std::move(cand);
+      j++;
+      continue;
+    }
+
+    if (side) _numSides = 2;
+
+    // the first duplicate adds the self check of the referenced geometry
+    if (_hashRefs.insert(parent).second) {
+      _selfChecks.push_back(parent);
+      diskAdd({_selfChecks.size() - 1,
+               1,
+               0,
+               cand.boxvalIn.val,
+               false,
+               type,
+               0.0,
+               {},
+               {},
+               false,
+               false});
+    }
+
+    _refs[parent.first][parent.second][cand.gid] = cand.subid;
+
+    if (cand.subid > 0) {
+      std::unique_lock<std::mutex> lock(_multiAddMtx);
+      multiAdd(cand.gid, side, cand.boxvalIn.val, cand.boxvalOut.val);
     }
+
+    if (_xRangesF.is_open() || _deltaBase) recordXRange(cand, true);
+  }
+
+  cands->resize(j);
+}
+
+// _____________________________________________________________________________
+void Sweeper::writeHashParent(const WriteCand& cand) {
+  uint64_t head[3] = {cand.gid.size(), cand.subid, cand.hashBytes.size()};
+
+  std::string rec(reinterpret_cast<const char*>(head), sizeof(head));
+  rec += cand.gid;
+  rec += cand.hashBytes;
+
+  ssize_t r = pwriteAll(_hashFile, reinterpret_cast<unsigned char*>(&rec[0]),
+                        rec.size(), _hashFileSize);
+
+  if (r < 0) {
+    std::stringstream ss;
+    ss << "Could not write to hash file\n";
+    ss << strerror(errno) << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  _hashFileSize += rec.size();
+}
+
+// _____________________________________________________________________________
+bool Sweeper::readHashParent(size_t off, const WriteCand& cand,
+                             std::pair<std::string, size_t>* parent) const {
+  uint64_t head[3];
+
+  ssize_t r = preadAll(_hashFile, reinterpret_cast<unsigned char*>(head),
+                       sizeof(head), off);
+
+  std::string rec;
+  if (r >= 0) {
+    rec.resize(head[0] + head[2]);
+    r = preadAll(_hashFile, reinterpret_cast<unsigned char*>(&rec[0]),
+                 rec.size(), off + sizeof(head));
+  }
+
+  if (r < 0) {
+    std::stringstream ss;
+    ss << "Could not read from hash file\n";
+    ss << strerror(errno) << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  if (rec.compare(0, head[0], cand.gid) == 0) return false;
+  if (rec.compare(head[0], head[2], cand.hashBytes) != 0) return false;
+
+  parent->first = rec.substr(0, head[0]);
+  parent->second = head[1];
+  return true;
+}
+
+// _____________________________________________________________________________
+void Sweeper::recordXRange(const WriteCand& cand, bool ref) {
+  int32_t left = cand.boxvalIn.val;
+  int32_t right = cand.boxvalOut.val;
+
+  if (_deltaBase) {
+    // geometries added on top of a delta base
+    _deltaIds.insert(cand.gid.substr(1));
+    _deltaXRanges.push_back({left, right});
+    return;
   }
+
+  writeString(_xRangesF, cand.gid);
+  _xRangesF.write(reinterpret_cast<const char*>(&left), sizeof(int32_t));
+  _xRangesF.write(reinterpret_cast<const char*>(&right), sizeof(int32_t));
+
+  // references don't have events of their own
+  if (!ref) _maxXWidth = std::max<int64_t>(_maxXWidth, int64_t(right) - left);
 }
 
 // _____________________________________________________________________________
-void Sweeper::clearMultis(bool force) {
+void Sweeper::clearMultis(bool force, int32_t bound) {
   JobBatch curBatch;
   size_t batchSize = 1000;
-  int32_t curMinThreadX = std::numeric_limits<int32_t>::max();
+  // the multi batches are spread round-robin over the workers
+  size_t numBatches = 0;
 
-  for (size_t i = 0; i < _cfg.numThreads; i++) {
-    if (_atomicCurX[i] < curMinThreadX) curMinThreadX = _atomicCurX[i];
-  }
+  // all jobs of the multi parts are queued, in progress or not yet queued
+  // and below bound
+  int32_t curMinThreadX = std::min(bound, _jobs.minPos());
 
   for (size_t i = 0; i < 2; i++) {
     for (auto a = _activeMultis[i].begin(); a != _activeMultis[i].end();) {
@@ -774,14 +1074,14 @@ void Sweeper::clearMultis(bool force) {
       }
 
       if (curBatch.size() > batchSize) {
-        _jobs.add(std::move(curBatch));
+        _jobs.add(std::move(curBatch), numBatches++);
         curBatch.clear();  // std doesnt guarantee that after move
         curBatch.reserve(batchSize);
       }
     }
   }
 
-  if (curBatch.size()) _jobs.add(std::move(curBatch));
+  if (curBatch.size()) _jobs.add(std::move(curBatch), numBatches);
 }
 
 // _____________________________________________________________________________
@@ -1060,13 +1360,24 @@ void Sweeper::multiOut(size_t tOut, const std::string& gidA) {
 
 // _____________________________________________________________________________
 void Sweeper::flush() {
+  if (!_axisChosen) {
+    // fewer geometries than the sample size were added
+    std::unique_lock<std::mutex> lock(_axisMtx);
+    chooseAxis();
+  }
+
   if (_numSides > 1) log("(Non-self join between 2 datasets)");
 
   log(std::to_string(_multiIds[0].size() + _multiIds[1].size()) +
       " multi geometries");
 
   for (const auto& ref : _refs) {
+    // the self checks of a loaded delta base are already in its events
+    if (_deltaBase && ref.first[0] == 'A') continue;
+
     for (const auto& sub : ref.second) {
+      if (_hashRefs.count({ref.first, sub.first})) continue;
+
       _selfChecks.push_back({ref.first, sub.first});
 
       diskAdd({_selfChecks.size() - 1,
@@ -1083,7 +1394,13 @@ void Sweeper::flush() {
     }
   }
 
-  for (size_t side = 0; side < 2; side++) {
+  // no more geometries will be added
+  _geomHashes[0] = {};
+  _geomHashes[1] = {};
+  _hashRefs = {};
+  if (_hashFile >= 0 && ftruncate(_hashFile, 0) == 0) _hashFileSize = 0;
+
+  for (size_t side = _deltaBase ? 1 : 0; side < 2; side++) {
     for (size_t i = 0; i < _multiIds[side].size(); i++) {
       diskAdd({i,
                1,
@@ -1099,17 +1416,11 @@ void Sweeper::flush() {
     }
   }
 
-  ssize_t r = writeAll(_file, _outBuffer, _obufpos);
-  if (r < 0) {
-    std::stringstream ss;
-    ss << "Could not write to events file '" << _fname << "'\n";
-    ss << strerror(errno) << std::endl;
-    throw std::runtime_error(ss.str());
-  }
-
-  delete[] _outBuffer;
+  // wait for the last spilled run to be written
+  waitForRun();
 
-  _obufpos = 0;
+  // geometries added on top of a delta base may contain new duplicates
+  _duplicatesRemoved = false;
 
   _pointCache.flush();
   _areaCache.flush();
@@ -1119,234 +1430,1100 @@ void Sweeper::flush() {
 
   log("Sorting events...");
 
-  std::string newFName = util::getTmpFName(_cache, ".spatialjoin", "sorttmp");
-  int newFile = open(newFName.c_str(), O_RDWR | O_CREAT, 0666);
-  unlink(newFName.c_str());
-
-  if (newFile < 0) {
-    throw std::runtime_error("Could not open temporary file " + newFName);
-    exit(1);
+  // if no run was spilled yet, all events are still in memory
+  if (_runs.size() == 1) {
+    sortInMemory();
+    log("...done");
+
+    // with a single stripe, duplicates are removed during the sweep
+    if (_cfg.numSweepStripes > 1) duplicatesToReferences();
+  } else if (_cfg.pipelineSweep && _cfg.numSweepStripes < 2) {
+    // the runs are merged during the sweep, duplicates are removed on the fly
+    sortExternal(true);
+    log("...deferred to the sweep");
+  } else {
+    sortExternal(false);
+    log("...done");
   }
 
-#ifdef __unix__
-  posix_fadvise(newFile, 0, 0, POSIX_FADV_SEQUENTIAL);
-#endif
-  r = util::externalSort(_file, newFile, sizeof(BoxVal), _curSweepId,
-                         _cfg.numThreads, boxCmp);
+  log(std::to_string(_refs.size()) + " reference geometries");
+}
 
-  if (r < 0) {
+// _____________________________________________________________________________
+std::string Sweeper::preparedFingerprint() const {
+  // everything which changes the events or the stored geometries
+  std::stringstream ss;
+  ss << "spatialjoin-prepared-3"
+     << " eventsize=" << _eventSize << " boxids=" << _cfg.useBoxIds
+     << " area=" << _cfg.useArea << " obb=" << _cfg.useOBB
+     << " diagbox=" << _cfg.useDiagBox << " innerouter=" << _cfg.useInnerOuter
+     << " singleevents=" << _cfg.singleEvents << " withindist="
+     << std::setprecision(17) << _cfg.withinDist;
+  return ss.str();
+}
+
+// _____________________________________________________________________________
+void Sweeper::storePrepared(const std::string& dir) {
+  // the stored events must be complete
+  finishMerge();
+
+  // with a single stripe and an in-memory sort, duplicates are only removed
+  // during the sweep, but the stored events are deduplicated
+  if (!_duplicatesRemoved) duplicatesToReferences();
+
+  log("Storing prepared dataset to " + dir + "...");
+
+  if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
     std::stringstream ss;
-    ss << "Could not sort events file '" << _fname << "'\n";
+    ss << "Could not create directory '" << dir << "'\n";
     ss << strerror(errno) << std::endl;
     throw std::runtime_error(ss.str());
   }
 
-  fsync(newFile);
+  // the sorted events
+  std::string evFName = dir + "/events";
+  int evFile = open(evFName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-  close(_file);
+  if (evFile < 0) {
+    std::stringstream ss;
+    ss << "Could not open events file '" << evFName << "'\n";
+    ss << strerror(errno) << std::endl;
+    throw std::runtime_error(ss.str());
+  }
 
-  _file = newFile;
+  struct stat st;
+  ssize_t r = fstat(_file, &st);
+  if (r >= 0) r = copyEvents(_file, evFile, 0, st.st_size);
 
-#ifdef __unix__
-  posix_fadvise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
-#endif
+  if (r < 0 || fsync(evFile) != 0) {
+    std::stringstream ss;
+    ss << "Could not write events file '" << evFName << "'\n";
+    ss << strerror(errno) << std::endl;
+    close(evFile);
+    throw std::runtime_error(ss.str());
+  }
 
-  log("...done");
+  close(evFile);
 
-  duplicatesToReferences();
+  // the geometries
+  _pointCache.store(dir + "/points");
+  _areaCache.store(dir + "/areas");
+  _simpleAreaCache.store(dir + "/simpleareas");
+  _lineCache.store(dir + "/lines");
+  _simpleLineCache.store(dir + "/simplelines");
 
-  log(std::to_string(_refs.size()) + " reference geometries");
-}
+  // the x ranges of all geometries, preceded by the maximum width
+  if (_xRangesF.is_open()) {
+    std::string xFName = dir + "/xranges";
+    std::ofstream xranges(xFName,
+                          std::ios::out | std::ios::binary | std::ios::trunc);
+    xranges.write(reinterpret_cast<const char*>(&_maxXWidth), sizeof(int64_t));
+    _xRangesF.flush();
+    _xRangesF.seekg(0);
+    if (_xRangesF.peek() != std::fstream::traits_type::eof()) {
+      xranges << _xRangesF.rdbuf();
+    }
+    _xRangesF.clear();
+    _xRangesF.seekp(0, std::ios::end);
 
-// _____________________________________________________________________________
-void Sweeper::duplicatesToReferences() {
-  // start at beginning of _file
-  lseek(_file, 0, SEEK_SET);
+    xranges.flush();
+    if (!xranges.good()) {
+      throw std::runtime_error("Could not write x range file " + xFName);
+    }
+  }
 
-  const size_t RBUF_SIZE = 100000;
-  unsigned char* buf = new unsigned char[sizeof(BoxVal) * RBUF_SIZE];
+  // the join metadata
+  std::string metaFName = dir + "/meta";
+  std::ofstream meta(metaFName,
+                     std::ios::out | std::ios::binary | std::ios::trunc);
 
-  std::unordered_set<size_t> deleted;
-  std::unordered_set<size_t> referenced;
+  writeString(meta, preparedFingerprint());
+  writeSize(meta, _transposed);
+  writeSize(meta, _curSweepId);
+  writeSize(meta, _numSides);
 
-  log("Removing duplicates...");
+  for (size_t side = 0; side < 2; side++) {
+    writeSize(meta, _multiIds[side].size());
+    for (size_t i = 0; i < _multiIds[side].size(); i++) {
+      writeString(meta, _multiIds[side][i]);
+      meta.write(reinterpret_cast<const char*>(&_multiLeftX[side][i]),
+                 sizeof(int32_t));
+      meta.write(reinterpret_cast<const char*>(&_multiRightX[side][i]),
+                 sizeof(int32_t));
+    }
+  }
 
-  ssize_t len;
-  size_t jj = 0;
+  writeSize(meta, _subSizes.size());
+  for (const auto& s : _subSizes) {
+    writeString(meta, s.first);
+    writeSize(meta, s.second);
+  }
+
+  writeSize(meta, _refs.size());
+  for (const auto& ref : _refs) {
+    writeString(meta, ref.first);
+    writeSize(meta, ref.second.size());
+    for (const auto& sub : ref.second) {
+      writeSize(meta, sub.first);
+      writeSize(meta, sub.second.size());
+      for (const auto& refd : sub.second) {
+        writeString(meta, refd.first);
+        writeSize(meta, refd.second);
+      }
+    }
+  }
 
-  int32_t curX = 0;
+  writeSize(meta, _selfChecks.size());
+  for (const auto& check : _selfChecks) {
+    writeString(meta, check.first);
+    writeSize(meta, check.second);
+  }
 
-  std::unordered_map<uint64_t, std::pair<size_t, bool>> duplicatePolys,
-      duplicateLines;
+  writeSize(meta, _selfCheckBounds.size());
+  for (const auto& b : _selfCheckBounds) {
+    writeString(meta, b.first);
+    meta.write(reinterpret_cast<const char*>(&b.second), sizeof(I32Box));
+  }
 
-  size_t pos = 0;
+  meta.flush();
 
-  try {
-    while ((len = preadAll(_file, buf, sizeof(BoxVal) * RBUF_SIZE, pos)) != 0) {
-      size_t posOld = pos;
-      pos += len;
-      if (len < 0) {
-        std::stringstream ss;
-        ss << "Could not read from events file '" << _fname << "'\n";
-        ss << strerror(errno) << std::endl;
-        throw std::runtime_error(ss.str());
-      }
+  if (!meta.good()) {
+    throw std::runtime_error("Could not write metadata file " + metaFName);
+  }
 
-      if (len % sizeof(BoxVal))
-        throw std::runtime_error("Corrupted events file");
+  log("...done");
+}
 
-      bool updated = false;
+// _____________________________________________________________________________
+void Sweeper::loadPrepared(const std::string& dir, bool delta) {
+  log("Loading prepared dataset from " + dir + "...");
 
-      for (ssize_t i = 0; i < len; i += sizeof(BoxVal)) {
-        auto cur = reinterpret_cast<BoxVal*>(buf + i);
+  _preparedDir = dir;
 
-        if (_cfg.sweepCancellationCb && jj % 10000 == 0) {
-          _cfg.sweepCancellationCb();
-        }
+  std::string metaFName = dir + "/meta";
+  std::ifstream meta(metaFName, std::ios::in | std::ios::binary);
 
-        jj++;
+  if (!meta.good()) {
+    throw std::runtime_error("Could not open metadata file " + metaFName);
+  }
 
-        if (cur->out) {
-          if ((cur->type == POLYGON || cur->type == LINE) &&
-              deleted.erase(cur->id)) {
-            // erase it if present, to avoid unnecessary memory consumption
-            cur->type = DELETED;
-            updated = true;
-          }
-          referenced.erase(cur->id);
-          continue;
-        }
+  std::string fingerprint = readString(meta);
 
-        if (curX != cur->val) {
-          // new equal-X block
-          duplicatePolys = {};
-          duplicateLines = {};
-          curX = cur->val;
-        }
+  if (fingerprint != preparedFingerprint()) {
+    std::stringstream ss;
+    ss << "Prepared dataset in '" << dir
+       << "' was created with incompatible options\n";
+    ss << "  stored:  " << fingerprint << "\n";
+    ss << "  current: " << preparedFingerprint() << std::endl;
+    throw std::runtime_error(ss.str());
+  }
 
-        if (cur->type == POLYGON &&
-            cur->point.getX() >= DUPLICATE_REMOVAL_MIN_SIZE) {
-          // for polygons, cur->point.getX() holds the number of anchor points
-          size_t h = cur->point.getX();
-          const auto& existing = duplicatePolys.find(h);
-
-          if (existing != duplicatePolys.end()) {
-            auto a = _areaCache.get(cur->id, cur->large ? -1 : 0);
-            auto b = _areaCache.get(existing->second.first,
-                                    existing->second.second ? -1 : 0);
-
-            if (a->box == b->box && a->area == b->area &&
-                a->boxIds == b->boxIds && a->geom == b->geom) {
-              deleted.insert(cur->id);
-              if (referenced.insert(existing->second.first).second) {
-                // for the first element referencing this, modify this
-                // event to the self check of the referenced geom
-                cur->type = SELF_CHECK_AREA;
-                _selfChecks.push_back({b->id, b->subId});
-                cur->id = _selfChecks.size() - 1;
-              } else {
-                cur->type = DELETED;
-              }
+  // geometries added on top of a delta base must be swept along the same axis
+  _transposed = readSize(meta);
+  _axisChosen = true;
 
-              updated = true;
-              _refs[b->id][b->subId][a->id] = a->subId;
-            }
-          } else {
-            duplicatePolys[h] = {(size_t)cur->id, cur->large};
-          }
-        }
+  _curSweepId = readSize(meta);
+  _numSides = readSize(meta);
 
-        if (cur->type == LINE &&
-            cur->point.getX() >= DUPLICATE_REMOVAL_MIN_SIZE) {
-          // for polygons, cur->point.getX() holds the number of anchor points
-          size_t h = cur->point.getX();
-          const auto& existing = duplicateLines.find(h);
-
-          if (existing != duplicateLines.end()) {
-            auto a = _lineCache.get(cur->id, cur->large ? -1 : 0);
-            auto b = _lineCache.get(existing->second.first,
-                                    existing->second.second ? -1 : 0);
-
-            if (a->box == b->box && a->length == b->length &&
-                a->boxIds == b->boxIds && a->geom == b->geom) {
-              deleted.insert(cur->id);
-              if (referenced.insert(existing->second.first).second) {
-                // for the first element referencing this, modify this
-                // event to the self check of the referenced geom
-                cur->type = SELF_CHECK_LINE;
-                _selfChecks.push_back({b->id, b->subId});
-                cur->id = _selfChecks.size() - 1;
-              } else {
-                cur->type = DELETED;
-              }
-              updated = true;
-              _refs[b->id][b->subId][a->id] = a->subId;
-            }
-          } else {
-            duplicateLines[h] = {(size_t)cur->id, cur->large};
-          }
-        }
+  for (size_t side = 0; side < 2; side++) {
+    size_t n = readSize(meta);
+    _multiIds[side].resize(n);
+    _multiLeftX[side].resize(n);
+    _multiRightX[side].resize(n);
+    _multiGidToId[side].clear();
+    for (size_t i = 0; i < n; i++) {
+      _multiIds[side][i] = readString(meta);
+      meta.read(reinterpret_cast<char*>(&_multiLeftX[side][i]),
+                sizeof(int32_t));
+      meta.read(reinterpret_cast<char*>(&_multiRightX[side][i]),
+                sizeof(int32_t));
+      _multiGidToId[side][_multiIds[side][i]] = i;
+    }
+  }
+
+  _subSizes.clear();
+  for (size_t n = readSize(meta); n > 0 && meta.good(); n--) {
+    std::string gid = readString(meta);
+    _subSizes[gid] = readSize(meta);
+  }
+
+  _refs.clear();
+  for (size_t n = readSize(meta); n > 0 && meta.good(); n--) {
+    auto& ref = _refs[readString(meta)];
+    for (size_t m = readSize(meta); m > 0 && meta.good(); m--) {
+      auto& sub = ref[readSize(meta)];
+      for (size_t k = readSize(meta); k > 0 && meta.good(); k--) {
+        std::string gid = readString(meta);
+        sub[gid] = readSize(meta);
       }
-
-      // if we changed something in this buffer, write it back
-      if (updated) pwriteAll(_file, buf, len, posOld);
     }
-  } catch (...) {
-    // graceful handling of an exception during sweep
+  }
 
-    delete[] buf;
+  _selfChecks.clear();
+  for (size_t n = readSize(meta); n > 0 && meta.good(); n--) {
+    std::string gid = readString(meta);
+    _selfChecks.push_back({gid, readSize(meta)});
+  }
 
-    // set the cancelled variable to true
-    _cancelled = true;
+  _selfCheckBounds.clear();
+  for (size_t n = readSize(meta); n > 0 && meta.good(); n--) {
+    std::string gid = readString(meta);
+    meta.read(reinterpret_cast<char*>(&_selfCheckBounds[gid]),
+              sizeof(I32Box));
+  }
 
-    // rethrow exception
-    throw;
+  if (!meta.good()) {
+    throw std::runtime_error("Could not read metadata file " + metaFName);
   }
 
-  delete[] buf;
+  _pointCache.load(dir + "/points");
+  _areaCache.load(dir + "/areas");
+  _simpleAreaCache.load(dir + "/simpleareas");
+  _lineCache.load(dir + "/lines");
+  _simpleLineCache.load(dir + "/simplelines");
 
-  log("...done");
-}
+  std::string evFName = dir + "/events";
+  int evFile = open(evFName.c_str(), O_RDONLY);
 
-// _____________________________________________________________________________
-void Sweeper::diskAdd(const BoxVal& bv) {
-  memcpy(_outBuffer + _obufpos, &bv, sizeof(BoxVal));
-  _obufpos += sizeof(BoxVal);
+  if (evFile < 0) {
+    std::stringstream ss;
+    ss << "Could not open events file '" << evFName << "'\n";
+    ss << strerror(errno) << std::endl;
+    throw std::runtime_error(ss.str());
+  }
 
-  if (_obufpos + sizeof(BoxVal) > BUFFER_S) {
-    ssize_t r = writeAll(_file, _outBuffer, _obufpos);
-    if (r < 0) {
-      std::stringstream ss;
-      ss << "Could not write to events file '" << _fname << "'\n";
-      ss << strerror(errno) << std::endl;
-      throw std::runtime_error(ss.str());
+  log("...done, " + std::to_string(numElements()) + " geometries, " +
+      std::to_string(_refs.size()) + " reference geometries");
+
+  if (delta) {
+    if (_numSides != 1) {
+      close(evFile);
+      throw std::runtime_error(
+          "Delta joins are only supported against self join datasets");
     }
-    _obufpos = 0;
-  }
-  _curSweepId++;
-}
+
+    // the delta geometries are added, spilled and sorted as usual, the base
+    // events are only read in the x ranges touched by them
+    _baseFile = evFile;
+    _baseSweepId = _curSweepId;
+    _curSweepId = 0;
+    _deltaBase = true;
+    return;
+  }
+
+  // the events are read as they are, nothing is spilled or sorted anymore
+  _duplicatesRemoved = true;
+  close(_file);
+  _file = evFile;
+  _fname = evFName;
+
+  delete[] _outBuffer;
+  _outBuffer = 0;
+  _obufpos = 0;
+
+#ifdef __unix__
+  posix_fadvise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+// _____________________________________________________________________________
+ssize_t Sweeper::copyEvents(int in, int out, size_t from, size_t to) const {
+  const size_t RBUF_SIZE = 100000;
+  unsigned char* buf = new unsigned char[_eventSize * RBUF_SIZE];
+
+  ssize_t r = 0;
+  for (size_t pos = from; r >= 0 && pos < to;) {
+    size_t n = std::min(to - pos, _eventSize * RBUF_SIZE);
+    r = preadAll(in, buf, n, pos);
+    if (r == static_cast<ssize_t>(n)) r = writeAll(out, buf, n);
+    if (r != static_cast<ssize_t>(n)) r = -1;
+    pos += n;
+  }
+
+  delete[] buf;
+  return r;
+}
+
+// _____________________________________________________________________________
+size_t Sweeper::eventIndexAt(int file, size_t numEvents, int32_t x) const {
+  // the x coordinate makes up the upper half of the sort key
+  uint64_t key = static_cast<uint64_t>(static_cast<uint32_t>(x) ^ 0x80000000u)
+                 << 32;
+
+  size_t lo = 0, hi = numEvents;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    uint64_t cur;
+    ssize_t r = preadAll(file, reinterpret_cast<unsigned char*>(&cur),
+                         sizeof(uint64_t), mid * _eventSize);
+    if (r != sizeof(uint64_t)) {
+      std::stringstream ss;
+      ss << "Could not read from events file\n";
+      ss << strerror(errno) << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+    if (cur < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+// _____________________________________________________________________________
+int64_t Sweeper::readXRanges(
+    const std::unordered_set<std::string>* changed,
+    std::vector<std::pair<int32_t, int32_t>>* ranges) const {
+  std::string xFName = _preparedDir + "/xranges";
+  std::ifstream xranges(xFName, std::ios::in | std::ios::binary);
+
+  if (!xranges.good()) {
+    throw std::runtime_error(
+        "Could not open x range file " + xFName +
+        ", delta joins require a dataset prepared with x ranges");
+  }
+
+  int64_t width = 0;
+  xranges.read(reinterpret_cast<char*>(&width), sizeof(int64_t));
+
+  if (!changed) return width;
+
+  while (xranges.peek() != std::ifstream::traits_type::eof()) {
+    std::string gid = readString(xranges);
+    int32_t left, right;
+    xranges.read(reinterpret_cast<char*>(&left), sizeof(int32_t));
+    xranges.read(reinterpret_cast<char*>(&right), sizeof(int32_t));
+
+    if (!xranges.good()) {
+      throw std::runtime_error("Could not read x range file " + xFName);
+    }
+
+    if (changed->count(gid.substr(1))) ranges->push_back({left, right});
+  }
+
+  return width;
+}
+
+// _____________________________________________________________________________
+size_t Sweeper::writeDeltaWindows(
+    int in, size_t numEvents, std::vector<std::pair<int32_t, int32_t>> ranges,
+    int64_t width, int out) {
+  // every geometry overlapping a range has both its events within width of
+  // that range
+  for (auto& r : ranges) {
+    r.first = std::max<int64_t>(std::numeric_limits<int32_t>::lowest(),
+                                int64_t(r.first) - width);
+    r.second = std::min<int64_t>(std::numeric_limits<int32_t>::max(),
+                                 int64_t(r.second) + width);
+  }
+
+  std::sort(ranges.begin(), ranges.end());
+
+  size_t ret = 0;
+  size_t lastTo = 0;
+
+  for (size_t i = 0; i < ranges.size();) {
+    // merge overlapping windows
+    int32_t left = ranges[i].first;
+    int32_t right = ranges[i].second;
+    for (i++; i < ranges.size() && ranges[i].first <= right; i++) {
+      right = std::max(right, ranges[i].second);
+    }
+
+    size_t from = std::max(lastTo, eventIndexAt(in, numEvents, left));
+    size_t to = right == std::numeric_limits<int32_t>::max()
+                    ? numEvents
+                    : eventIndexAt(in, numEvents, right + 1);
+
+    if (to > from &&
+        copyEvents(in, out, from * _eventSize, to * _eventSize) < 0) {
+      std::stringstream ss;
+      ss << "Could not write delta events file\n";
+      ss << strerror(errno) << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+
+    ret += to > from ? to - from : 0;
+    lastTo = std::max(lastTo, to);
+
+    // multi geometries starting before the window don't have their
+    // multi-IN event in it
+    for (size_t j = 0; j < _multiIds[0].size(); j++) {
+      if (_multiLeftX[0][j] <= right && _multiRightX[0][j] >= left) {
+        _activeMultis[0].insert(j);
+      }
+    }
+  }
+
+  return ret;
+}
+
+// _____________________________________________________________________________
+int Sweeper::openTmpEvents() {
+  std::string fname = util::getTmpFName(_cache, ".spatialjoin", "delta-events");
+  int file = open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+  if (file < 0) {
+    throw std::runtime_error("Could not open temporary file " + fname);
+  }
+
+  // immediately unlink
+  unlink(fname.c_str());
+
+  return file;
+}
+
+// _____________________________________________________________________________
+RelStats Sweeper::sweepDeltaAdded(
+    const std::unordered_set<std::string>& changed) {
+  if (!_deltaBase) throw std::runtime_error("No delta base loaded");
+
+  // the delta events are merged with the base events below
+  finishMerge();
+
+  log("Sweeping " + std::to_string(_deltaIds.size()) +
+      " added or modified geometries...");
+
+  size_t numDelta = _curSweepId;
+
+  // base events in the x ranges of the delta geometries
+  int in = openTmpEvents();
+  size_t numBase =
+      writeDeltaWindows(_baseFile, _baseSweepId, _deltaXRanges,
+                        readXRanges(0, 0), in);
+
+  if (numBase == 0) {
+    close(in);
+  } else if (numDelta == 0) {
+    close(_file);
+    _file = in;
+  } else {
+    // both are sorted, merge them into a single events file
+    if (copyEvents(_file, in, 0, numDelta * _eventSize) < 0) {
+      close(in);
+      std::stringstream ss;
+      ss << "Could not write delta events file\n";
+      ss << strerror(errno) << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+
+    int out = openTmpEvents();
+    ssize_t r = mergeEventRuns(in, out, _eventSize,
+                               {0, numBase, numBase + numDelta},
+                               _cfg.numThreads, [](size_t, size_t) {});
+    close(in);
+
+    if (r < 0) {
+      close(out);
+      std::stringstream ss;
+      ss << "Could not merge delta events file\n";
+      ss << strerror(errno) << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+
+    close(_file);
+    _file = out;
+  }
+
+  log(std::to_string(numBase) + " base events in the delta x ranges");
+
+  _curSweepId = numBase + numDelta;
+  _changed = changed;
+  _deltaMode = DELTA_ADDED;
+
+  return sweep();
+}
+
+// _____________________________________________________________________________
+RelStats Sweeper::sweepDeltaRetracted(
+    const std::unordered_set<std::string>& changed) {
+  log("Sweeping " + std::to_string(changed.size()) +
+      " deleted or modified geometries...");
+
+  std::vector<std::pair<int32_t, int32_t>> ranges;
+  int64_t width = readXRanges(&changed, &ranges);
+
+  // the loaded events in the x ranges of the changed geometries
+  int out = openTmpEvents();
+  size_t num = writeDeltaWindows(_file, _curSweepId, ranges, width, out);
+
+  log(std::to_string(num) + " events in the x ranges of " +
+      std::to_string(ranges.size()) + " changed geometries");
+
+  close(_file);
+  _file = out;
+  _curSweepId = num;
+  _changed = changed;
+  _deltaMode = DELTA_RETRACTED;
+
+  return sweep();
+}
+
+// _____________________________________________________________________________
+void Sweeper::sortInMemory() {
+  size_t total = _curSweepId * _eventSize;
+
+  unsigned char* tmp = 0;
+  unsigned char* sorted = _outBuffer;
+
+  // presorted input doesn't have to be sorted again
+  if (!eventsSorted(_outBuffer, _curSweepId, _eventSize)) {
+    tmp = new unsigned char[total];
+    sorted =
+        sortEvents(_outBuffer, tmp, _curSweepId, _eventSize, _cfg.numThreads);
+  }
+
+  ssize_t r = pwriteAll(_file, sorted, total, 0);
+
+  delete[] _outBuffer;
+  delete[] tmp;
+
+  _outBuffer = 0;
+  _obufpos = 0;
+
+  if (r < 0 || static_cast<size_t>(r) != total) {
+    std::stringstream ss;
+    ss << "Could not write to events file '" << _fname << "'\n";
+    ss << strerror(errno) << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+#ifdef __unix__
+  posix_fadvise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+// _____________________________________________________________________________
+void Sweeper::sortExternal(bool pipelined) {
+  // the remaining events form the last run
+  size_t n = _obufpos / _eventSize;
+  _runs.push_back(_runs.back() + n);
+  writeRun(_outBuffer, n);
+
+  _outBuffer = 0;
+  _obufpos = 0;
+
+  if (_spillExc) std::rethrow_exception(_spillExc);
+
+  // runs which are already in order (for presorted input) are not merged
+  std::vector<size_t> runs = coalesceEventRuns(_file, _eventSize, _runs);
+
+  if (runs.empty()) {
+    std::stringstream ss;
+    ss << "Could not read from events file '" << _fname << "'\n";
+    ss << strerror(errno) << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  if (runs.size() <= 2) {
+    // the events file is already sorted
+    log("(Events are presorted, skipping merge)");
+    if (_cfg.numSweepStripes > 1) duplicatesToReferences();
+
+#ifdef __unix__
+    posix_fadvise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return;
+  }
+
+  std::string newFName = util::getTmpFName(_cache, ".spatialjoin", "sorttmp");
+  int newFile = open(newFName.c_str(), O_RDWR | O_CREAT, 0666);
+  unlink(newFName.c_str());
+
+  if (newFile < 0) {
+    throw std::runtime_error("Could not open temporary file " + newFName);
+    exit(1);
+  }
+
+#ifdef __unix__
+  posix_fadvise(newFile, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  _mergeRunFile = _file;
+  _mergeRuns = runs;
+  _file = newFile;
+
+  // a pipelined sweep merges the runs itself
+  if (!pipelined) finishMerge();
+}
+
+// _____________________________________________________________________________
+void Sweeper::finishMerge() {
+  if (_mergeRunFile < 0) return;
+
+  // duplicates are removed from each merged bucket while the later buckets
+  // are still being merged
+  DuplicateState state;
+
+  mergeRuns([&](size_t from, size_t to) {
+    duplicatesToReferences(from * _eventSize, to * _eventSize, &state);
+  });
+
+  _duplicatesRemoved = true;
+}
+
+// _____________________________________________________________________________
+void Sweeper::mergeRuns(const std::function<void(size_t, size_t)>& bucketCb) {
+  int runFile = _mergeRunFile;
+  std::vector<size_t> runs = std::move(_mergeRuns);
+  _mergeRunFile = -1;
+  _mergeRuns = {};
+
+  ssize_t r;
+
+  try {
+    r = mergeEventRuns(runFile, _file, _eventSize, runs, _cfg.numThreads,
+                       bucketCb);
+  } catch (...) {
+    close(runFile);
+    throw;
+  }
+
+  close(runFile);
+
+  if (r < 0) {
+    std::stringstream ss;
+    ss << "Could not sort events file '" << _fname << "'\n";
+    ss << strerror(errno) << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  fsync(_file);
+
+#ifdef __unix__
+  posix_fadvise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+// _____________________________________________________________________________
+void Sweeper::spillRun() {
+  // at most one run is sorted and written in the background, while the
+  // parsing continues into a fresh buffer
+  waitForRun();
+
+  size_t n = _obufpos / _eventSize;
+  _runs.push_back(_runs.back() + n);
+
+  _spillThr = std::thread(&Sweeper::writeRun, this, _outBuffer, n);
+
+  _outBuffer = new unsigned char[_runSize];
+  _obufpos = 0;
+}
+
+// _____________________________________________________________________________
+void Sweeper::writeRun(unsigned char* run, size_t numEvents) {
+  unsigned char* tmp = 0;
+  unsigned char* sorted = run;
+
+  if (!eventsSorted(run, numEvents, _eventSize)) {
+    tmp = new unsigned char[numEvents * _eventSize];
+    sorted = sortEvents(run, tmp, numEvents, _eventSize, _cfg.numThreads);
+  }
+
+  ssize_t r = writeAll(_file, sorted, numEvents * _eventSize);
+
+  delete[] run;
+  delete[] tmp;
+
+  if (r < 0) {
+    std::stringstream ss;
+    ss << "Could not write to events file '" << _fname << "'\n";
+    ss << strerror(errno) << std::endl;
+    _spillExc = std::make_exception_ptr(std::runtime_error(ss.str()));
+  }
+}
+
+// _____________________________________________________________________________
+void Sweeper::waitForRun() {
+  if (_spillThr.joinable()) _spillThr.join();
+  if (_spillExc) std::rethrow_exception(_spillExc);
+}
+
+// _____________________________________________________________________________
+void Sweeper::duplicatesToReferences() {
+  log("Removing duplicates...");
+
+  DuplicateState state;
+  duplicatesToReferences(0, std::numeric_limits<size_t>::max(), &state);
+  _duplicatesRemoved = true;
+
+  log("...done");
+}
+
+// _____________________________________________________________________________
+void Sweeper::duplicatesToReferences(size_t from, size_t to,
+                                     DuplicateState* state) {
+  const size_t RBUF_SIZE = 100000;
+  EventReader reader(_file, _eventSize * RBUF_SIZE, true, from, to);
+  unsigned char* buf;
+
+  auto& jj = state->jj;
+
+  ssize_t len;
+
+  try {
+    while ((len = reader.next(&buf)) != 0) {
+      if (len < 0) {
+        std::stringstream ss;
+        ss << "Could not read from events file '" << _fname << "'\n";
+        ss << strerror(errno) << std::endl;
+        throw std::runtime_error(ss.str());
+      }
+
+      if (len % _eventSize) throw std::runtime_error("Corrupted events file");
+
+      bool updated = false;
+
+      for (ssize_t i = 0; i < len; i += _eventSize) {
+        BoxVal curVal = decodeEvent(buf + i);
+        auto cur = &curVal;
+
+        if (_cfg.sweepCancellationCb && jj % 10000 == 0) {
+          _cfg.sweepCancellationCb();
+        }
+
+        jj++;
+
+        if (removeDuplicate(cur, state)) {
+          encodeEvent(*cur, buf + i);
+          updated = true;
+        }
+      }
+
+      // if we changed something in this buffer, write it back
+      if (updated && reader.writeBack() < 0) {
+        std::stringstream ss;
+        ss << "Could not write to events file '" << _fname << "'\n";
+        ss << strerror(errno) << std::endl;
+        throw std::runtime_error(ss.str());
+      }
+    }
+  } catch (...) {
+    // graceful handling of an exception during sweep
+
+    // set the cancelled variable to true
+    _cancelled = true;
+
+    // rethrow exception
+    throw;
+  }
+}
 
 // _____________________________________________________________________________
-RelStats Sweeper::sweep() {
-  // start at beginning of _file
-  lseek(_file, 0, SEEK_SET);
+bool Sweeper::removeDuplicate(BoxVal* cur, DuplicateState* state) {
+  auto& deleted = state->deleted;
+  auto& referenced = state->referenced;
+  auto& curX = state->curX;
+
+  if (cur->out) {
+    if ((cur->type == POLYGON || cur->type == LINE) &&
+        deleted.erase(DuplicateState::key(cur->type, cur->id))) {
+      // erase it if present, to avoid unnecessary memory consumption
+      cur->type = DELETED;
+      return true;
+    }
+    return false;
+  }
+
+  if (curX != cur->val) {
+    // new equal-X block, duplicates share the x of their IN event, so no
+    // geometry of an earlier block is referenced again. This also holds if
+    // only IN events are stored and the OUT events never get here
+    state->duplicatePolys = {};
+    state->duplicateLines = {};
+    if (!referenced.empty()) referenced = {};
+    curX = cur->val;
+  }
+
+  if (cur->type != POLYGON && cur->type != LINE) return false;
+
+  // for polygons and lines, cur->point.getX() holds the number of anchor
+  // points
+  if (cur->point.getX() < DUPLICATE_REMOVAL_MIN_SIZE) return false;
+
+  // only geometries of the same side reference each other
+  uint64_t h = (static_cast<uint64_t>(cur->point.getX()) << 1) | cur->side;
+
+  auto& duplicates =
+      cur->type == POLYGON ? state->duplicatePolys : state->duplicateLines;
+  const auto& existing = duplicates.find(h);
+
+  if (existing == duplicates.end()) {
+    duplicates[h] = {(size_t)cur->id, cur->large};
+    return false;
+  }
+
+  std::string aId, bId;
+  size_t aSub, bSub;
+
+  if (cur->type == POLYGON) {
+    auto a = _areaCache.get(cur->id, cur->large ? -1 : 0);
+    auto b = _areaCache.get(existing->second.first,
+                            existing->second.second ? -1 : 0);
+
+    if (!(a->box == b->box && a->area == b->area && a->boxIds == b->boxIds &&
+          a->geom == b->geom))
+      return false;
+
+    aId = a->id;
+    aSub = a->subId;
+    bId = b->id;
+    bSub = b->subId;
+  } else {
+    auto a = _lineCache.get(cur->id, cur->large ? -1 : 0);
+    auto b = _lineCache.get(existing->second.first,
+                            existing->second.second ? -1 : 0);
+
+    if (!(a->box == b->box && a->length == b->length &&
+          a->boxIds == b->boxIds && a->geom == b->geom))
+      return false;
+
+    aId = a->id;
+    aSub = a->subId;
+    bId = b->id;
+    bSub = b->subId;
+  }
+
+  // if only IN events are stored, the deleted IN event doesn't restore an
+  // OUT event
+  if (!_cfg.singleEvents) {
+    deleted.insert(DuplicateState::key(cur->type, cur->id));
+  }
+
+  // during the sweep, workers concurrently read the references
+  std::unique_lock<std::shared_timed_mutex> lock(_refsMtx);
+
+  if (referenced.insert(DuplicateState::key(cur->type, existing->second.first))
+          .second) {
+    // for the first element referencing this, modify this event to the self
+    // check of the referenced geom
+    cur->type = cur->type == POLYGON ? SELF_CHECK_AREA : SELF_CHECK_LINE;
+    _selfChecks.push_back({bId, bSub});
+    cur->id = _selfChecks.size() - 1;
+  } else {
+    cur->type = DELETED;
+  }
+
+  _refs[bId][bSub][aId] = aSub;
+
+  return true;
+}
+
+// _____________________________________________________________________________
+void Sweeper::diskAdd(const BoxVal& in, const BoxVal& out) {
+  if (_cfg.singleEvents) {
+    // the OUT event is restored from the IN event during the sweep
+    diskAdd(in, &out);
+  } else {
+    diskAdd(in);
+    diskAdd(out);
+  }
+}
+
+// _____________________________________________________________________________
+void Sweeper::diskAdd(const BoxVal& bv, const BoxVal* out) {
+  encodeEvent(bv, _outBuffer + _obufpos);
+  if (_cfg.singleEvents) encodeOutEvent(out, _outBuffer + _obufpos);
+  _obufpos += _eventSize;
+  _curSweepId++;
+
+  // sort full buffers and spill them as a run
+  if (_obufpos + _eventSize > _runSize) spillRun();
+}
+
+// _____________________________________________________________________________
+void Sweeper::encodeEvent(const BoxVal& bv, unsigned char* buf) const {
+  DiskEvent ev;
+  memset(&ev, 0, sizeof(DiskEvent));
+
+  ev.key = eventKey(bv);
+  ev.loY = bv.loY;
+  ev.upY = bv.upY;
+  ev.id = bv.id;
+  ev.x = bv.point.getX();
+  ev.flags = (bv.type << 1) | (bv.out ? EVENT_OUT : 0) |
+             (bv.side ? EVENT_SIDE : 0) | (bv.large ? EVENT_LARGE : 0) |
+             (bv.point.getY() == bv.upY ? EVENT_UPPER : 0);
+
+  memcpy(buf, &ev, sizeof(DiskEvent));
+  buf += sizeof(DiskEvent);
+
+  if (_cfg.useDiagBox) {
+    int32_t b45[4] = {bv.b45.getLowerLeft().getX(),
+                      bv.b45.getLowerLeft().getY(),
+                      bv.b45.getUpperRight().getX(),
+                      bv.b45.getUpperRight().getY()};
+    memcpy(buf, b45, sizeof(b45));
+    buf += sizeof(b45);
+  }
+
+  if (_cfg.withinDist >= 0) {
+    // padded boxes, the event point is not necessarily on the box border
+    int32_t y[2] = {bv.point.getY(), 0};
+    memcpy(buf, y, sizeof(y));
+  }
+}
+
+// _____________________________________________________________________________
+sj::BoxVal Sweeper::decodeEvent(const unsigned char* buf) const {
+  const auto ev = reinterpret_cast<const DiskEvent*>(buf);
+  buf += sizeof(DiskEvent);
+
+  BoxVal bv;
+  bv.id = ev->id;
+  bv.loY = ev->loY;
+  bv.upY = ev->upY;
+  bv.val = eventVal(ev);
+  bv.out = eventOut(ev);
+  bv.type = eventType(ev);
+  bv.side = ev->flags & EVENT_SIDE;
+  bv.large = ev->flags & EVENT_LARGE;
+  bv.areaOrLen = eventAreaOrLen(ev);
+
+  int32_t y = 0;
+
+  if (bv.type == POINT || bv.type == FOLDED_POINT) {
+    y = ev->loY;
+  } else if (bv.type == FOLDED_BOX_POLYGON || bv.type == SIMPLE_LINE ||
+             bv.type == FOLDED_SIMPLE_LINE) {
+    y = (ev->flags & EVENT_UPPER) ? ev->upY : ev->loY;
+  }
+
+  if (_cfg.useDiagBox) {
+    int32_t b45[4];
+    memcpy(b45, buf, sizeof(b45));
+    bv.b45 = I32Box({b45[0], b45[1]}, {b45[2], b45[3]});
+    buf += sizeof(b45);
+  }
+
+  if (_cfg.withinDist >= 0) memcpy(&y, buf, sizeof(int32_t));
+
+  bv.point = I32Point(ev->x, y);
+
+  return bv;
+}
+
+// _____________________________________________________________________________
+size_t Sweeper::outEventOffset() const {
+  return sizeof(DiskEvent) + (_cfg.useDiagBox ? 4 * sizeof(int32_t) : 0) +
+         (_cfg.withinDist >= 0 ? 2 * sizeof(int32_t) : 0);
+}
+
+// _____________________________________________________________________________
+void Sweeper::encodeOutEvent(const BoxVal* out, unsigned char* buf) const {
+  // events without an OUT event (self checks, multi-INs) get an empty slot
+  int32_t ext[4] = {0, 0, 0, 0};
+
+  if (out) {
+    ext[0] = out->val;
+    ext[1] = out->point.getX();
+    ext[2] = out->point.getY();
+  }
+
+  // for unpadded boxes, the OUT event point can be derived from the IN event
+  memcpy(buf + outEventOffset(), ext,
+         (_cfg.withinDist >= 0 ? 4 : 2) * sizeof(int32_t));
+}
+
+// _____________________________________________________________________________
+sj::BoxVal Sweeper::decodeOutEvent(const BoxVal& in,
+                                   const unsigned char* buf) const {
+  int32_t ext[4];
+  memcpy(ext, buf + outEventOffset(),
+         (_cfg.withinDist >= 0 ? 4 : 2) * sizeof(int32_t));
+
+  BoxVal out = in;
+  out.val = ext[0];
+  out.out = true;
 
+  if (_cfg.withinDist >= 0) {
+    out.point = I32Point(ext[1], ext[2]);
+  } else if (in.type == FOLDED_BOX_POLYGON || isSimpleLine(in.type)) {
+    // the lower left corner, or the other end point of the line
+    out.point = I32Point(in.val, in.point.getY() == in.loY ? in.upY : in.loY);
+  }
+
+  return out;
+}
+
+// _____________________________________________________________________________
+RelStats Sweeper::sweep() {
   _cancelled = false;
 
   const size_t batchSize = 100000;
   JobBatch curBatch;
+  size_t batchCost = 0;
 
   const size_t RBUF_SIZE = 100000;
-  unsigned char* buf = new unsigned char[sizeof(BoxVal) * RBUF_SIZE];
+  std::unique_ptr<EventReader> reader;
+  unsigned char* buf;
 
   ssize_t len;
 
-  util::geo::IntervalIdx<int32_t, SweepVal> actives[2];
+  // in a pipelined sweep, the runs are merged in the background and each
+  // merged key range is read as soon as it and all ranges before it are
+  // complete. mergedTo is the end of the merged prefix, in events
+  std::thread mergeThr;
+  std::mutex mergeMtx;
+  std::condition_variable mergeCv;
+  size_t mergedTo = 0, readTo = 0;
+  bool mergeDone = false;
+  std::exception_ptr mergeExc;
+
+  if (_mergeRunFile < 0) {
+    reader.reset(new EventReader(_file, _eventSize * RBUF_SIZE, false));
+  } else {
+    log("Merging the sorted runs during the sweep...");
+    mergeThr = std::thread([&]() {
+      try {
+        mergeRuns([&](size_t, size_t to) {
+          if (_cancelled) throw std::runtime_error("Sweep cancelled");
+          {
+            std::unique_lock<std::mutex> lock(mergeMtx);
+            mergedTo = to;
+          }
+          mergeCv.notify_all();
+        });
+      } catch (...) {
+        mergeExc = std::current_exception();
+      }
+      {
+        std::unique_lock<std::mutex> lock(mergeMtx);
+        mergeDone = true;
+      }
+      mergeCv.notify_all();
+    });
+  }
+
+  auto nextBlock = [&](unsigned char** block) -> ssize_t {
+    while (true) {
+      ssize_t n = reader ? reader->next(block) : 0;
+      if (n != 0 || !mergeThr.joinable()) return n;
+
+      // wait for the next merged key range
+      size_t from = readTo;
+      {
+        std::unique_lock<std::mutex> lock(mergeMtx);
+        mergeCv.wait(lock, [&]() { return mergedTo > from || mergeDone; });
+        if (mergedTo == from) return 0;
+        readTo = mergedTo;
+      }
+
+      reader.reset(new EventReader(_file, _eventSize * RBUF_SIZE, false,
+                                   from * _eventSize, readTo * _eventSize));
+    }
+  };
+
+  ActiveSet<SweepVal> actives[2];
+
+  // OUT events restored from IN events, if only IN events are stored
+  OutHeap outs;
 
   _stats.resize(_cfg.numThreads + 1);
   _relStats.resize(_cfg.numThreads + 1);
   _checks.resize(_cfg.numThreads);
-  _curX.resize(_cfg.numThreads);
   _subEquals.resize(_cfg.numThreads + 1);
   _subCovered.resize(_cfg.numThreads + 1);
   _subContains.resize(_cfg.numThreads + 1);
@@ -1370,18 +2547,483 @@ RelStats Sweeper::sweep() {
   _mutsCrosses = std::vector<std::mutex>(_cfg.numThreads + 1);
   _mutsDistance = std::vector<std::mutex>(_cfg.numThreads + 1);
   _mutsDE9IM = std::vector<std::mutex>(_cfg.numThreads + 1);
-  _atomicCurX = std::vector<std::atomic<int32_t>>(_cfg.numThreads + 1);
 
-  size_t counts = 0, totalCheckCount = 0, jj = 0, checkPairs = 0;
-  auto t = TIME();
+  size_t counts = 0, totalCheckCount = 0, jj = 0, checkPairs = 0;
+  auto t = TIME();
+
+  // with a single stripe, duplicates are turned into references on the fly,
+  // the sweep passes the equal-x blocks in the same order as a separate pass
+  DuplicateState dups;
+
+  // fire up worker threads for geometry checking
+  std::vector<std::thread> thrds(_cfg.numThreads);
+  for (size_t i = 0; i < thrds.size(); i++)
+    thrds[i] = std::thread(&Sweeper::processQueue, this, i);
+
+  if (_cfg.prefetch) startPrefetch();
+
+  try {
+    if (_cfg.numSweepStripes > 1) {
+      sweepStripes(batchSize, &counts, &checkPairs);
+    } else {
+      while ((len = nextBlock(&buf)) != 0) {
+        if (len < 0) {
+          std::stringstream ss;
+          ss << "Could not read from events file '" << _fname << "'\n";
+          ss << strerror(errno) << std::endl;
+          throw std::runtime_error(ss.str());
+        }
+
+        if (len % _eventSize) throw std::runtime_error("Corrupted events file");
+
+        for (ssize_t i = 0; i < len; i += _eventSize) {
+          BoxVal curVal = decodeEvent(buf + i);
+          auto cur = &curVal;
+
+          if (_cfg.sweepCancellationCb && jj % 10000 == 0) {
+            _cfg.sweepCancellationCb();
+          }
+
+          jj++;
+
+          if (!_duplicatesRemoved) removeDuplicate(cur, &dups);
+
+          // restored OUT events which come before this event
+          if (_cfg.singleEvents) {
+            sweepOuts(&outs, reinterpret_cast<const DiskEvent*>(buf + i)->key,
+                      actives, &curBatch, &batchCost, batchSize, &counts,
+                      &checkPairs);
+          }
+
+          // the jobs not yet queued are not covered by the scheduler, and the
+          // parts of a multi right of this event have no jobs yet
+          if (jj % 200000 == 0)
+            clearMultis(false, std::min(cur->val, batchMinX(curBatch)));
+
+          if (_cfg.evictRetired && jj % RETIRE_EVICT_INTERVAL == 0) {
+            evictRetired(batchMinX(curBatch));
+          }
+
+          if (cur->type == DELETED) {
+            continue;
+          } else if (isSelfCheck(cur->type)) {
+            // self checks, required if we have reference geoms
+            curBatch.push_back({*cur, *cur, ""});
+          } else if (isMultiIn(cur)) {
+            // special multi-IN
+            _activeMultis[cur->side].insert(cur->id);
+          } else if (!cur->out) {
+            // IN event
+            insertActive(actives, cur);
+
+            if (_cfg.singleEvents) {
+              const BoxVal out = decodeOutEvent(*cur, buf + i);
+              outs.push({eventKey(out), out});
+            }
+
+            if (jj % 500000 == 0) {
+              auto lon =
+                  _transposed
+                      ? webMercToLatLng<double>(0, (1.0 * cur->val) / PREC)
+                            .getY()
+                      : webMercToLatLng<double>((1.0 * cur->val) / PREC, 0)
+                            .getX();
+              totalCheckCount += checkPairs;
+
+              auto cacheSizePoint = _pointCache.size();
+              auto cacheSizeArea = _areaCache.size();
+              auto cacheSizeSimpleArea = _simpleAreaCache.size();
+              auto cacheSizeSimpleLine = _simpleLineCache.size();
+              auto cacheSizeLine = _lineCache.size();
+
+              log(std::to_string(jj / eventsPerGeom()) + " / " +
+                  std::to_string(_curSweepId / eventsPerGeom()) + " (" +
+                  std::to_string((((1.0 * jj) / (1.0 * _curSweepId)) * 100)) +
+                  "%, " +
+                  std::to_string((500000.0 / double(TOOK(t))) * 1000000000.0) +
+                  " geoms/s, " +
+                  std::to_string((checkPairs / double(TOOK(t))) *
+                                 1000000000.0) +
+                  " pairs/s), avg. " +
+                  std::to_string(((1.0 * totalCheckCount) / (1.0 * counts))) +
+                  " checks/geom, " + (_transposed ? "sweepLat=" : "sweepLon=") +
+                  std::to_string(lon) + "°, |A|=" +
+                  std::to_string(actives[0].size() + actives[1].size()) +
+                  ", JQ est. cost=" + std::to_string(_jobs.size()) +
+                  ", |A_mult|=" +
+                  std::to_string(_activeMultis[0].size() +
+                                 _activeMultis[1].size()) +
+                  ", |C|=" +
+                  std::to_string(cacheSizePoint.first + cacheSizeArea.first +
+                                 cacheSizeSimpleArea.first +
+                                 cacheSizeSimpleLine.first +
+                                 cacheSizeLine.first) +
+                  " (" +
+                  util::readableSize(
+                      cacheSizePoint.second + cacheSizeArea.second +
+                      cacheSizeSimpleArea.second + cacheSizeSimpleLine.second +
+                      cacheSizeLine.second) +
+                  ")");
+              t = TIME();
+              checkPairs = 0;
+            }
+
+            if ((jj % 100 == 0) && _cfg.sweepProgressCb)
+              _cfg.sweepProgressCb(jj / eventsPerGeom());
+          } else {
+            // OUT event
+            sweepOut(cur, actives, &curBatch, &batchCost, batchSize, &counts,
+                     &checkPairs);
+          }
+        }
+      }
+
+      // an error during the merge ends the ranges early
+      if (mergeThr.joinable()) mergeThr.join();
+      if (mergeExc) std::rethrow_exception(mergeExc);
+
+      // remaining restored OUT events
+      sweepOuts(&outs, std::numeric_limits<uint64_t>::max(), actives,
+                &curBatch, &batchCost, batchSize, &counts, &checkPairs);
+    }
+  } catch (...) {
+    // graceful handling of an exception during sweep
+
+    // set the cancelled variable to true
+    _cancelled = true;
+
+    // the merge stops at its next finished key range
+    if (mergeThr.joinable()) mergeThr.join();
+
+    // signal all threads to shut down once the job queue is empty
+    _jobs.done();
+
+    // again wait for all workers to finish
+    for (auto& thr : thrds)
+      if (thr.joinable()) thr.join();
+
+    stopPrefetch();
+
+    // rethrow exception
+    throw;
+  }
+
+  if (!_cfg.noGeometryChecks && curBatch.size())
+    queueBatch(std::move(curBatch));
+
+  // signal all threads to shut down once the job queue is empty
+  _jobs.done();
+
+  // wait for all workers to finish
+  for (auto& thr : thrds)
+    if (thr.joinable()) thr.join();
+
+  stopPrefetch();
+
+  // everything has been checked and all workers are idle, so the remaining
+  // retired geometries are evicted as well
+  if (_cfg.evictRetired) evictRetired(std::numeric_limits<int32_t>::max());
+  _retired.clear();
+
+  // empty job queue
+  _jobs.reset();
+  // fire up new workers to clear multis
+  for (size_t i = 0; i < thrds.size(); i++)
+    thrds[i] = std::thread(&Sweeper::processQueue, this, i);
+
+  // now also clear the multis
+  clearMultis(true, std::numeric_limits<int32_t>::max());
+  // signal all threads to shut down once the job queue is empty
+  _jobs.done();
+
+  // again wait for all workers to finish
+  for (auto& thr : thrds)
+    if (thr.joinable()) thr.join();
+
+  // final check count aggregation
+  totalCheckCount += checkPairs;
+
+  // aggregate total stats
+  Stats sum;
+  for (auto s : _stats) sum += s;
+
+  // aggregate total stats
+  RelStats sumRel;
+  for (auto s : _relStats) sumRel += s;
+
+  if (_cfg.statsCb) {
+    _cfg.statsCb(sum.toString() + "\n\n");
+    _cfg.statsCb(cacheStats() + "\n");
+    _cfg.statsCb(sumRel.toString() + "\n");
+  }
+
+  return sumRel;
+}
+
+// _____________________________________________________________________________
+void Sweeper::retire(const BoxVal& cur) {
+  // folded geometries are stored in their ids, not in the caches
+  if (cur.type != POLYGON && cur.type != SIMPLE_POLYGON && cur.type != LINE &&
+      cur.type != SIMPLE_LINE && cur.type != POINT)
+    return;
+
+  _retired.push_back({cur.val, cur.type, cur.id});
+}
+
+// _____________________________________________________________________________
+int32_t Sweeper::batchMinX(const JobBatch& batch) {
+  int32_t ret = std::numeric_limits<int32_t>::max();
+  for (const auto& job : batch) ret = std::min(ret, job.boxVal.val);
+  return ret;
+}
+
+// _____________________________________________________________________________
+void Sweeper::evictRetired(int32_t bound) {
+  int32_t curMinThreadX = std::min(bound, _jobs.minPos());
+
+  // all jobs of a geometry are created at its OUT event at the latest, and
+  // the position of their chunk is at most the x of this event. So once the
+  // lower bound of all queued, in-progress and not yet queued jobs has
+  // passed x, no job references the geometry anymore
+  while (!_retired.empty() && _retired.front().x < curMinThreadX) {
+    const RetiredGeom& r = _retired.front();
+
+    if (r.type == POLYGON) {
+      _areaCache.evict(r.id);
+    } else if (r.type == SIMPLE_POLYGON) {
+      _simpleAreaCache.evict(r.id);
+    } else if (r.type == LINE) {
+      _lineCache.evict(r.id);
+    } else if (r.type == SIMPLE_LINE) {
+      _simpleLineCache.evict(r.id);
+    } else {
+      _pointCache.evict(r.id);
+    }
+
+    _numRetiredEvicted++;
+    _retired.pop_front();
+  }
+}
+
+// _____________________________________________________________________________
+std::string Sweeper::cacheStats() const {
+  std::stringstream ss;
+
+  auto line = [&ss](const std::string& name, std::pair<size_t, size_t> hits) {
+    size_t total = hits.first + hits.second;
+    ss << "geo cache hit rate of " << name << ": "
+       << (total ? (100.0 * hits.first) / total : 0) << "% (" << hits.first
+       << " hits, " << hits.second << " misses)\n";
+  };
+
+  line("AREAS", _areaCache.hits());
+  line("SIMPLE AREAS", _simpleAreaCache.hits());
+  line("LINES", _lineCache.hits());
+  line("SIMPLE LINES", _simpleLineCache.hits());
+  line("POINTS", _pointCache.hits());
+
+  if (_cfg.evictRetired) {
+    ss << "retired geometries evicted from the geo caches: "
+       << _numRetiredEvicted << "\n";
+  }
+
+  return ss.str();
+}
+
+// _____________________________________________________________________________
+void Sweeper::sweepOut(const BoxVal* cur, ActiveSet<SweepVal>* actives,
+                       JobBatch* curBatch, size_t* batchCost,
+                       size_t batchSize, size_t* counts, size_t* checkPairs) {
+  actives[cur->side].erase(cur->loY, cur->upY, {cur->id, cur->type});
+
+  // stripes are swept concurrently, so the worker positions are no bound for
+  // the pending jobs of a geometry
+  if (_cfg.evictRetired && _cfg.numSweepStripes <= 1) retire(*cur);
+
+  (*counts)++;
+
+  int sideB = ((int)(cur->side) + 1) % _numSides;
+
+  size_t from = curBatch->size();
+  fillBatch(curBatch, &actives[sideB], cur);
+
+  // in a delta join, the added geometries are also checked against each other
+  if (_deltaMode == DELTA_ADDED && cur->side)
+    fillBatch(curBatch, &actives[1], cur);
+
+  for (size_t i = from; i < curBatch->size(); i++)
+    *batchCost += (*curBatch)[i].cost;
+
+  // batches are cut by their estimated cost, the size limit only bounds
+  // batches of very cheap checks
+  if (*batchCost > JOB_BATCH_MAX_COST || curBatch->size() > batchSize) {
+    *checkPairs += curBatch->size();
+    if (!_cfg.noGeometryChecks) queueBatch(std::move(*curBatch));
+    curBatch->clear();  // std doesnt guarantee that after move
+    curBatch->reserve(batchSize + 100);
+    *batchCost = 0;
+  }
+}
+
+// _____________________________________________________________________________
+void Sweeper::sweepOuts(OutHeap* outs, uint64_t upTo,
+                        ActiveSet<SweepVal>* actives, JobBatch* curBatch,
+                        size_t* batchCost, size_t batchSize, size_t* counts,
+                        size_t* checkPairs) {
+  // restored OUT events never share a key with an event on disk, as the
+  // latter are never OUT events
+  while (!outs->empty() && outs->top().key < upTo) {
+    const BoxVal cur = outs->top().bv;
+    outs->pop();
+    sweepOut(&cur, actives, curBatch, batchCost, batchSize, counts,
+             checkPairs);
+  }
+}
+
+// _____________________________________________________________________________
+void Sweeper::sweepStripes(size_t batchSize, size_t* counts,
+                           size_t* checkPairs) {
+  // the sorted events are split into stripes of (roughly) equal event count.
+  // Each pair is reported in the stripe containing the OUT event of the
+  // geometry which leaves first, against the geometries active at that
+  // position. To reproduce this set of active geometries, each stripe is
+  // seeded with the geometries which entered in an earlier stripe and have
+  // not left yet. These are collected in a first, cheap parallel pass.
+  size_t numStripes = std::min(_cfg.numSweepStripes, _curSweepId);
+  if (numStripes == 0) return;
+
+  log("Sweeping " + std::to_string(numStripes) + " stripes in parallel...");
+
+  std::vector<size_t> bounds(numStripes + 1);
+  for (size_t i = 0; i <= numStripes; i++) {
+    bounds[i] = ((_curSweepId * i) / numStripes) * _eventSize;
+  }
+
+  // the sort keys of the first event of each stripe. If only IN events are
+  // stored, a stripe sweeps the restored OUT events up to the next stripe
+  std::vector<uint64_t> keys(numStripes + 1,
+                             std::numeric_limits<uint64_t>::max());
+  if (_cfg.singleEvents) {
+    for (size_t i = 0; i < numStripes; i++) {
+      ssize_t r = preadAll(_file, reinterpret_cast<unsigned char*>(&keys[i]),
+                           sizeof(uint64_t), bounds[i]);
+      if (r != sizeof(uint64_t)) {
+        std::stringstream ss;
+        ss << "Could not read from events file '" << _fname << "'\n";
+        ss << strerror(errno) << std::endl;
+        throw std::runtime_error(ss.str());
+      }
+    }
+  }
+
+  std::vector<StripeBorder> borders(numStripes);
+  std::vector<std::exception_ptr> excs(numStripes);
+  std::vector<std::thread> thrds(numStripes);
+
+  _numSwept = 0;
+
+  for (size_t i = 0; i < numStripes; i++)
+    thrds[i] = std::thread(&Sweeper::scanStripe, this, bounds[i],
+                           bounds[i + 1], keys[i + 1], &borders[i], &excs[i]);
+
+  for (auto& thr : thrds) thr.join();
+
+  for (const auto& exc : excs)
+    if (exc) std::rethrow_exception(exc);
+
+  // geometries active at the beginning of each stripe
+  std::vector<std::vector<BoxVal>> carries(numStripes);
+  std::vector<std::vector<BoxVal>> carryOuts(numStripes);
+
+  if (_cfg.singleEvents) {
+    std::vector<BoxVal> carry, carryOut;
+
+    for (size_t i = 0; i < numStripes; i++) {
+      // drop geometries which left before this stripe
+      size_t j = 0;
+      for (size_t k = 0; k < carry.size(); k++) {
+        if (eventKey(carryOut[k]) < keys[i]) continue;
+        carry[j] = carry[k];
+        carryOut[j] = carryOut[k];
+        j++;
+      }
+      carry.resize(j);
+      carryOut.resize(j);
+
+      carries[i] = carry;
+      carryOuts[i] = carryOut;
+
+      carry.insert(carry.end(), borders[i].open.begin(),
+                   borders[i].open.end());
+      carryOut.insert(carryOut.end(), borders[i].openOut.begin(),
+                      borders[i].openOut.end());
+
+      // multis are cleared once all stripes have passed them
+      for (const auto& m : borders[i].multis)
+        _activeMultis[m.first].insert(m.second);
+
+      borders[i] = {};
+    }
+  } else {
+    std::unordered_multimap<ActiveKey, BoxVal, ActiveKeyHash> carry;
+
+    for (size_t i = 0; i < numStripes; i++) {
+      carries[i].reserve(carry.size());
+      for (const auto& c : carry) carries[i].push_back(c.second);
+
+      for (const auto& out : borders[i].closed) {
+        auto it = carry.find(activeKey(out));
+        if (it != carry.end()) carry.erase(it);
+      }
+
+      for (const auto& in : borders[i].open) carry.insert({activeKey(in), in});
+
+      // multis are cleared once all stripes have passed them
+      for (const auto& m : borders[i].multis)
+        _activeMultis[m.first].insert(m.second);
+
+      borders[i] = {};
+    }
+  }
+
+  std::vector<size_t> stripeCounts(numStripes, 0);
+  std::vector<size_t> stripeCheckPairs(numStripes, 0);
+
+  // no stripe has published its position yet
+  _stripeX = std::vector<std::atomic<int32_t>>(numStripes);
+  for (auto& x : _stripeX) x = std::numeric_limits<int32_t>::min();
+
+  for (size_t i = 0; i < numStripes; i++)
+    thrds[i] =
+        std::thread(&Sweeper::sweepStripe, this, i, bounds[i], bounds[i + 1],
+                    keys[i + 1], &carries[i], &carryOuts[i], batchSize,
+                    &stripeCounts[i], &stripeCheckPairs[i], &excs[i]);
+
+  for (auto& thr : thrds) thr.join();
+
+  for (const auto& exc : excs)
+    if (exc) std::rethrow_exception(exc);
 
-  // fire up worker threads for geometry checking
-  std::vector<std::thread> thrds(_cfg.numThreads);
-  for (size_t i = 0; i < thrds.size(); i++)
-    thrds[i] = std::thread(&Sweeper::processQueue, this, i);
+  for (size_t i = 0; i < numStripes; i++) {
+    *counts += stripeCounts[i];
+    *checkPairs += stripeCheckPairs[i];
+  }
+
+  log("...done");
+}
 
+// _____________________________________________________________________________
+void Sweeper::scanStripe(size_t from, size_t to, uint64_t toKey,
+                         StripeBorder* border, std::exception_ptr* exc) {
   try {
-    while ((len = readAll(_file, buf, sizeof(BoxVal) * RBUF_SIZE)) != 0) {
+    const size_t RBUF_SIZE = 100000;
+    EventReader reader(_file, _eventSize * RBUF_SIZE, false, from, to);
+    unsigned char* buf;
+    ssize_t len;
+
+    std::unordered_multimap<ActiveKey, BoxVal, ActiveKeyHash> actives;
+
+    while ((len = reader.next(&buf)) != 0) {
       if (len < 0) {
         std::stringstream ss;
         ss << "Could not read from events file '" << _fname << "'\n";
@@ -1389,167 +3031,150 @@ RelStats Sweeper::sweep() {
         throw std::runtime_error(ss.str());
       }
 
-      if (len % sizeof(BoxVal))
-        throw std::runtime_error("Corrupted events file");
-
-      for (ssize_t i = 0; i < len; i += sizeof(BoxVal)) {
-        auto cur = reinterpret_cast<const BoxVal*>(buf + i);
+      if (len % _eventSize) throw std::runtime_error("Corrupted events file");
 
-        if (_cfg.sweepCancellationCb && jj % 10000 == 0) {
-          _cfg.sweepCancellationCb();
-        }
+      for (ssize_t i = 0; i < len; i += _eventSize) {
+        if (_cancelled) return;
 
-        jj++;
+        const BoxVal cur = decodeEvent(buf + i);
 
-        if (jj % 200000 == 0) clearMultis(false);
+        if (cur.type == DELETED || isSelfCheck(cur.type)) continue;
 
-        if (cur->type == DELETED) {
-          continue;
-        } else if (cur->type == SELF_CHECK || cur->type == SELF_CHECK_AREA ||
-                   cur->type == SELF_CHECK_LINE ||
-                   cur->type == SELF_CHECK_POINT) {
-          // self checks, required if we have reference geoms
-          curBatch.push_back({*cur, *cur, ""});
-        } else if (!cur->out && cur->loY == 1 && cur->upY == 0 &&
-                   cur->type == POINT) {
-          // special multi-IN
-          _activeMultis[cur->side].insert(cur->id);
-        } else if (!cur->out) {
-          // IN event
-          actives[cur->side].insert(
-              {cur->loY, cur->upY},
-              {cur->id,
-               cur->type,
-               cur->b45,
-               cur->point,
-               {cur->val, cur->point.getY() == cur->loY ? cur->upY : cur->loY},
-               cur->side,
-               cur->large});
-
-          if (jj % 500000 == 0) {
-            auto lon =
-                webMercToLatLng<double>((1.0 * cur->val) / PREC, 0).getX();
-            totalCheckCount += checkPairs;
-
-            auto cacheSizePoint = _pointCache.size();
-            auto cacheSizeArea = _areaCache.size();
-            auto cacheSizeSimpleArea = _simpleAreaCache.size();
-            auto cacheSizeSimpleLine = _simpleLineCache.size();
-            auto cacheSizeLine = _lineCache.size();
-
-            log(std::to_string(jj / 2) + " / " +
-                std::to_string(_curSweepId / 2) + " (" +
-                std::to_string((((1.0 * jj) / (1.0 * _curSweepId)) * 100)) +
-                "%, " +
-                std::to_string((500000.0 / double(TOOK(t))) * 1000000000.0) +
-                " geoms/s, " +
-                std::to_string((checkPairs / double(TOOK(t))) * 1000000000.0) +
-                " pairs/s), avg. " +
-                std::to_string(((1.0 * totalCheckCount) / (1.0 * counts))) +
-                " checks/geom, sweepLon=" + std::to_string(lon) + "°, |A|=" +
-                std::to_string(actives[0].size() + actives[1].size()) +
-                ", |JQ|=" + std::to_string(_jobs.size()) + " (x" +
-                std::to_string(batchSize) + "), |A_mult|=" +
-                std::to_string(_activeMultis[0].size() +
-                               _activeMultis[1].size()) +
-                ", |C|=" +
-                std::to_string(cacheSizePoint.first + cacheSizeArea.first +
-                               cacheSizeSimpleArea.first +
-                               cacheSizeSimpleLine.first +
-                               cacheSizeLine.first) +
-                " (" +
-                util::readableSize(
-                    cacheSizePoint.second + cacheSizeArea.second +
-                    cacheSizeSimpleArea.second + cacheSizeSimpleLine.second +
-                    cacheSizeLine.second) +
-                ")");
-            t = TIME();
-            checkPairs = 0;
+        if (isMultiIn(&cur)) {
+          border->multis.push_back({cur.side, cur.id});
+        } else if (_cfg.singleEvents) {
+          // the geometry is still active at the end of the stripe if its OUT
+          // event comes after it
+          const BoxVal out = decodeOutEvent(cur, buf + i);
+          if (eventKey(out) >= toKey) {
+            border->open.push_back(cur);
+            border->openOut.push_back(out);
           }
-
-          if ((jj % 100 == 0) && _cfg.sweepProgressCb)
-            _cfg.sweepProgressCb(jj / 2);
+        } else if (!cur.out) {
+          actives.insert({activeKey(cur), cur});
         } else {
-          // OUT event
-          actives[cur->side].erase({cur->loY, cur->upY}, {cur->id, cur->type});
-
-          counts++;
-
-          int sideB = ((int)(cur->side) + 1) % _numSides;
-
-          fillBatch(&curBatch, &actives[sideB], cur);
-
-          if (curBatch.size() > batchSize) {
-            checkPairs += curBatch.size();
-            if (!_cfg.noGeometryChecks) _jobs.add(std::move(curBatch));
-            curBatch.clear();  // std doesnt guarantee that after move
-            curBatch.reserve(batchSize + 100);
+          auto it = actives.find(activeKey(cur));
+          if (it != actives.end()) {
+            actives.erase(it);
+          } else {
+            border->closed.push_back(cur);
           }
         }
       }
     }
+
+    border->open.reserve(border->open.size() + actives.size());
+    for (const auto& a : actives) border->open.push_back(a.second);
   } catch (...) {
-    // graceful handling of an exception during sweep
+    _cancelled = true;
+    *exc = std::current_exception();
+  }
+}
 
-    delete[] buf;
+// _____________________________________________________________________________
+void Sweeper::sweepStripe(size_t stripe, size_t from, size_t to,
+                          uint64_t toKey, const std::vector<BoxVal>* carry,
+                          const std::vector<BoxVal>* carryOut,
+                          size_t batchSize, size_t* counts, size_t* checkPairs,
+                          std::exception_ptr* exc) {
+  try {
+    const size_t RBUF_SIZE = 100000;
+    EventReader reader(_file, _eventSize * RBUF_SIZE, false, from, to);
+    unsigned char* buf;
+    ssize_t len;
 
-    // set the cancelled variable to true
-    _cancelled = true;
+    JobBatch curBatch;
+    size_t batchCost = 0;
 
-    // the DONE element on the job queue to signal all threads to shut down
-    _jobs.add({});
+    ActiveSet<SweepVal> actives[2];
+    for (const auto& bv : *carry) insertActive(actives, &bv);
 
-    // again wait for all workers to finish
-    for (auto& thr : thrds)
-      if (thr.joinable()) thr.join();
+    OutHeap outs;
+    for (const auto& bv : *carryOut) outs.push({eventKey(bv), bv});
 
-    // rethrow exception
-    throw;
-  }
+    size_t swept = 0;
 
-  delete[] buf;
+    while ((len = reader.next(&buf)) != 0) {
+      if (len < 0) {
+        std::stringstream ss;
+        ss << "Could not read from events file '" << _fname << "'\n";
+        ss << strerror(errno) << std::endl;
+        throw std::runtime_error(ss.str());
+      }
 
-  if (!_cfg.noGeometryChecks && curBatch.size()) _jobs.add(std::move(curBatch));
+      if (len % _eventSize) throw std::runtime_error("Corrupted events file");
 
-  // the DONE element on the job queue to signal all threads to shut down
-  _jobs.add({});
+      for (ssize_t i = 0; i < len; i += _eventSize) {
+        if (_cancelled) return;
 
-  // wait for all workers to finish
-  for (auto& thr : thrds)
-    if (thr.joinable()) thr.join();
+        const BoxVal curVal = decodeEvent(buf + i);
+        auto cur = &curVal;
 
-  // empty job queue
-  _jobs.reset();
-  // fire up new workers to clear multis
-  for (size_t i = 0; i < thrds.size(); i++)
-    thrds[i] = std::thread(&Sweeper::processQueue, this, i);
+        size_t jj = ++_numSwept;
 
-  // now also clear the multis
-  clearMultis(true);
-  // the DONE element on the job queue to signal all threads to shut down
-  _jobs.add({});
+        if (jj % 10000 == 0 &&
+            (_cfg.sweepCancellationCb || _cfg.sweepProgressCb)) {
+          std::unique_lock<std::mutex> lock(_sweepCbMtx);
+          if (_cfg.sweepCancellationCb) _cfg.sweepCancellationCb();
+          if (_cfg.sweepProgressCb)
+            _cfg.sweepProgressCb(jj / eventsPerGeom());
+        }
 
-  // again wait for all workers to finish
-  for (auto& thr : thrds)
-    if (thr.joinable()) thr.join();
+        // restored OUT events which come before this event
+        if (_cfg.singleEvents) {
+          sweepOuts(&outs, reinterpret_cast<const DiskEvent*>(buf + i)->key,
+                    actives, &curBatch, &batchCost, batchSize, counts,
+                    checkPairs);
+        }
 
-  // final check count aggregation
-  totalCheckCount += checkPairs;
+        if (++swept % 200000 == 0) {
+          // the jobs this stripe queued before are covered by the scheduler
+          _stripeX[stripe] = std::min(cur->val, batchMinX(curBatch));
 
-  // aggregate total stats
-  Stats sum;
-  for (auto s : _stats) sum += s;
+          // the positions of all stripes are read before the scheduler's
+          int32_t bound = std::numeric_limits<int32_t>::max();
+          for (const auto& x : _stripeX) bound = std::min<int32_t>(bound, x);
 
-  // aggregate total stats
-  RelStats sumRel;
-  for (auto s : _relStats) sumRel += s;
+          std::unique_lock<std::mutex> lock(_stripeMultisMtx,
+                                            std::try_to_lock);
+          if (lock) clearMultis(false, bound);
+        }
 
-  if (_cfg.statsCb) {
-    _cfg.statsCb(sum.toString() + "\n\n");
-    _cfg.statsCb(sumRel.toString() + "\n");
-  }
+        if (cur->type == DELETED || isMultiIn(cur)) {
+          // multi-INs were already collected in scanStripe()
+          continue;
+        } else if (isSelfCheck(cur->type)) {
+          // self checks, required if we have reference geoms
+          curBatch.push_back({*cur, *cur, ""});
+        } else if (!cur->out) {
+          // IN event
+          insertActive(actives, cur);
 
-  return sumRel;
+          if (_cfg.singleEvents) {
+            const BoxVal out = decodeOutEvent(*cur, buf + i);
+            outs.push({eventKey(out), out});
+          }
+        } else {
+          // OUT event
+          sweepOut(cur, actives, &curBatch, &batchCost, batchSize, counts,
+                   checkPairs);
+        }
+      }
+    }
+
+    // restored OUT events up to the next stripe, the others are swept there
+    sweepOuts(&outs, toKey, actives, &curBatch, &batchCost, batchSize, counts,
+              checkPairs);
+
+    *checkPairs += curBatch.size();
+    if (!_cfg.noGeometryChecks && curBatch.size())
+      queueBatch(std::move(curBatch));
+
+    _stripeX[stripe] = std::numeric_limits<int32_t>::max();
+  } catch (...) {
+    _cancelled = true;
+    *exc = std::current_exception();
+  }
 }
 
 // _____________________________________________________________________________
@@ -2285,7 +3910,17 @@ void Sweeper::writeRel(size_t t, const std::string& a, const std::string& b,
 
   auto ts = TIME();
 
-  if (_numSides == 2 && (a[0] != 'A' || a[0] == b[0])) return;
+  if (_deltaMode == DELTA_ADDED) {
+    // at least one added or modified geometry, and no old versions of
+    // changed base geometries
+    if (a[0] == 'A' && (b[0] == 'A' || _changed.count(a.substr(1)))) return;
+    if (b[0] == 'A' && _changed.count(b.substr(1))) return;
+  } else if (_deltaMode == DELTA_RETRACTED) {
+    // at least one changed geometry
+    if (!_changed.count(a.substr(1)) && !_changed.count(b.substr(1))) return;
+  } else if (_numSides == 2 && (a[0] != 'A' || a[0] == b[0])) {
+    return;
+  }
 
   _cfg.writeRelCb(t, a.c_str() + 1, a.size() - 1, b.c_str() + 1, b.size() - 1,
                   pred.c_str(), pred.size());
@@ -2338,30 +3973,36 @@ void Sweeper::writeDE9IM(size_t t, const std::string& a, size_t aSub,
 
   // handle references
 
-  if (_refs.size() == 0) return;
-
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeDE9IM(t, a, aSub, idB.first, idB.second, de9im);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeDE9IM(t, a, aSub, idB.first, idB.second, de9im);
   }
 
-  if (referersA != _refs.end()) {
-    const auto& subs = referersA->second.find(aSub);
-    if (subs != referersA->second.end()) {
-      for (const auto& idA : subs->second) {
-        writeDE9IM(t, idA.first, idA.second, b, bSub, de9im);
-      }
-    }
+  for (const auto& idA : referers(a, aSub)) {
+    writeDE9IM(t, idA.first, idA.second, b, bSub, de9im);
   }
 }
 
+// ____________________________________________________________________________
+std::vector<std::pair<std::string, size_t>> Sweeper::referers(
+    const std::string& gid, size_t sub) const {
+  // duplicates found during the sweep are added concurrently
+  std::shared_lock<std::shared_timed_mutex> lock(_refsMtx);
+
+  auto refs = _refs.find(gid);
+  if (refs == _refs.end()) return {};
+
+  auto subs = refs->second.find(sub);
+  if (subs == refs->second.end()) return {};
+
+  return {subs->second.begin(), subs->second.end()};
+}
+
+// ____________________________________________________________________________
+bool Sweeper::isReferenced(const std::string& gid) const {
+  std::shared_lock<std::shared_timed_mutex> lock(_refsMtx);
+  return _refs.count(gid);
+}
+
 // ____________________________________________________________________________
 void Sweeper::writeDist(size_t t, const std::string& a, size_t aSub,
                         const std::string& b, size_t bSub, double dist) {
@@ -2383,29 +4024,14 @@ void Sweeper::writeDist(size_t t, const std::string& a, size_t aSub,
 
   // handle references
 
-  if (_refs.size() == 0) return;
-
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeDist(t, a, aSub, idB.first, idB.second, dist);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeDist(t, a, aSub, idB.first, idB.second, dist);
   }
 
   // no need to check exactly the same direction again
   if (a != b || aSub != bSub) {
-    if (referersA != _refs.end()) {
-      const auto& subs = referersA->second.find(aSub);
-      if (subs != referersA->second.end()) {
-        for (const auto& idA : subs->second) {
-          writeDist(t, idA.first, idA.second, b, bSub, dist);
-        }
-      }
+    for (const auto& idA : referers(a, aSub)) {
+      writeDist(t, idA.first, idA.second, b, bSub, dist);
     }
   }
 }
@@ -2420,35 +4046,33 @@ void Sweeper::writeIntersect(size_t t, const std::string& a, size_t aSub,
     writeRel(t, b, a, _cfg.sepIsect);
   }
 
-  if (_refs.size() == 0) return;
-
   // handle references
 
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeIntersect(t, a, aSub, idB.first, idB.second);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeIntersect(t, a, aSub, idB.first, idB.second);
   }
 
   // no need to check exactly the same direction again
   if (a != b || aSub != bSub) {
-    if (referersA != _refs.end()) {
-      const auto& subs = referersA->second.find(aSub);
-      if (subs != referersA->second.end()) {
-        for (const auto& idA : subs->second) {
-          writeIntersect(t, idA.first, idA.second, b, bSub);
-        }
-      }
+    for (const auto& idA : referers(a, aSub)) {
+      writeIntersect(t, idA.first, idA.second, b, bSub);
     }
   }
 }
 
+// ____________________________________________________________________________
+void Sweeper::selfCheck(size_t id, GeomType type, size_t t) {
+  std::pair<std::string, size_t> check;
+
+  {
+    // duplicates found during the sweep are added concurrently
+    std::shared_lock<std::shared_timed_mutex> lock(_refsMtx);
+    check = _selfChecks[id];
+  }
+
+  selfCheck(check.first, check.second, type, t);
+}
+
 // ____________________________________________________________________________
 void Sweeper::selfCheck(const std::string& a, size_t subId, GeomType type,
                         size_t t) {
@@ -2477,15 +4101,10 @@ void Sweeper::selfCheck(const std::string& a, size_t subId, GeomType type,
 // ____________________________________________________________________________
 void Sweeper::doDE9IMCheck(const JobVal cur, const JobVal sv, size_t t) {
   _checks[t]++;
-  _curX[t] = cur.val;
-
-  // every 10000 checks, update our position
-  if (_checks[t] % 10000 == 0) _atomicCurX[t] = _curX[t];
 
   if (cur.type == SELF_CHECK || cur.type == SELF_CHECK_AREA ||
       cur.type == SELF_CHECK_LINE || cur.type == SELF_CHECK_POINT)
-    return selfCheck(_selfChecks[cur.id].first, _selfChecks[cur.id].second,
-                     cur.type, t);
+    return selfCheck(cur.id, cur.type, t);
 
   if (isPoint(cur.type) && isPoint(sv.type)) {
     auto p1 = cur.point;
@@ -2718,15 +4337,10 @@ void Sweeper::doDE9IMCheck(const JobVal cur, const JobVal sv, size_t t) {
 // ____________________________________________________________________________
 void Sweeper::doDistCheck(const JobVal cur, const JobVal sv, size_t t) {
   _checks[t]++;
-  _curX[t] = cur.val;
-
-  // every 10000 checks, update our position
-  if (_checks[t] % 10000 == 0) _atomicCurX[t] = _curX[t];
 
   if (cur.type == SELF_CHECK || cur.type == SELF_CHECK_AREA ||
       cur.type == SELF_CHECK_LINE || cur.type == SELF_CHECK_POINT)
-    return selfCheck(_selfChecks[cur.id].first, _selfChecks[cur.id].second,
-                     cur.type, t);
+    return selfCheck(cur.id, cur.type, t);
 
   if (isPoint(cur.type) && isPoint(sv.type)) {
     auto p1 = cur.point;
@@ -2888,17 +4502,26 @@ void Sweeper::doDistCheck(const JobVal cur, const JobVal sv, size_t t) {
 }
 
 // ____________________________________________________________________________
-void Sweeper::doCheck(const JobVal cur, const JobVal sv, size_t t) {
+void Sweeper::doCheck(JobVal cur, JobVal sv, size_t t) {
   _checks[t]++;
-  _curX[t] = cur.val;
-
-  // every 10000 checks, update our position
-  if (_checks[t] % 10000 == 0) _atomicCurX[t] = _curX[t];
 
   if (cur.type == SELF_CHECK || cur.type == SELF_CHECK_AREA ||
       cur.type == SELF_CHECK_LINE || cur.type == SELF_CHECK_POINT)
-    return selfCheck(_selfChecks[cur.id].first, _selfChecks[cur.id].second,
-                     cur.type, t);
+    return selfCheck(cur.id, cur.type, t);
+
+  // the event key only holds a truncated line length, so at equal x the
+  // longer line may leave first. Only the shorter one can be covered, so
+  // check it as the leaving one. Pairs of two LINEs are swapped below.
+  if ((isSimpleLine(cur.type) || isSimpleLine(sv.type)) &&
+      (cur.type == LINE || isSimpleLine(cur.type)) &&
+      (sv.type == LINE || isSimpleLine(sv.type))) {
+    auto len = [this, t](const JobVal& jv) -> double {
+      if (jv.type == LINE)
+        return _lineCache.get(jv.id, jv.large ? -1 : t)->length;
+      return util::geo::len(LineSegment<int32_t>(jv.point, jv.point2));
+    };
+    if (len(sv) < len(cur)) std::swap(cur, sv);
+  }
 
   if (isArea(cur.type) && isArea(sv.type)) {
     std::shared_ptr<Area> a = getArea(cur, cur.large ? -1 : t);
@@ -2906,6 +4529,10 @@ void Sweeper::doCheck(const JobVal cur, const JobVal sv, size_t t) {
 
     if (a->id == b->id) return;  // no self-checks in multigeometries
 
+    // the event key only holds a truncated area, so at equal x the larger
+    // area may leave first. Only the smaller one can be contained.
+    if (b->area < a->area) std::swap(a, b);
+
     _stats[t].areaCmps++;
     _stats[t].areaSizeSum += std::max(a->area, b->area);
 
@@ -2952,7 +4579,7 @@ void Sweeper::doCheck(const JobVal cur, const JobVal sv, size_t t) {
     } else if (std::get<0>(res)) {
       // if a is not a multi-geom, and is completey covered, we wont
       // be finding a touch as we assume non-self-intersecting geoms
-      if (_refs.count(a->id) || !(a->subId == 0 && std::get<2>(res))) {
+      if (isReferenced(a->id) || !(a->subId == 0 && std::get<2>(res))) {
         writeNotTouches(t, a->id, a->subId, b->id, b->subId);
       }
     }
@@ -3008,7 +4635,7 @@ void Sweeper::doCheck(const JobVal cur, const JobVal sv, size_t t) {
     } else if (std::get<0>(res)) {
       // if a is not a multi-geom, and is completey covered, we wont
       // be finding a touch as we assume non-self-intersecting geoms
-      if (_refs.count(a->id) || !(a->subId == 0 && std::get<2>(res))) {
+      if (isReferenced(a->id) || !(a->subId == 0 && std::get<2>(res))) {
         writeNotTouches(t, a->id, a->subId, b->id, b->subId);
       }
     }
@@ -3061,7 +4688,7 @@ void Sweeper::doCheck(const JobVal cur, const JobVal sv, size_t t) {
     if (std::get<3>(res)) {
       writeTouches(t, a->id, 0, b->id, b->subId);
     } else if (std::get<0>(res)) {
-      if (_refs.count(a->id) || !(std::get<2>(res))) {
+      if (isReferenced(a->id) || !(std::get<2>(res))) {
         writeNotTouches(t, a->id, 0, b->id, b->subId);
       }
     }
@@ -3118,7 +4745,7 @@ void Sweeper::doCheck(const JobVal cur, const JobVal sv, size_t t) {
     } else if (std::get<0>(res)) {
       // if b is not a multi-geom, and is completey covered, we wont
       // be finding a touch as we assume non-self-intersecting geoms
-      if (_refs.count(a->id) || !(b->subId == 0 && std::get<2>(res))) {
+      if (isReferenced(a->id) || !(b->subId == 0 && std::get<2>(res))) {
         writeNotTouches(t, a->id, a->subId, b->id, b->subId);
       }
     }
@@ -3169,7 +4796,7 @@ void Sweeper::doCheck(const JobVal cur, const JobVal sv, size_t t) {
     if (std::get<3>(res)) {
       writeTouches(t, a->id, a->subId, b->id, 0);
     } else if (std::get<0>(res)) {
-      if (_refs.count(a->id) || !std::get<2>(res)) {
+      if (isReferenced(a->id) || !std::get<2>(res)) {
         writeNotTouches(t, a->id, a->subId, b->id, 0);
       }
     }
@@ -3187,6 +4814,9 @@ void Sweeper::doCheck(const JobVal cur, const JobVal sv, size_t t) {
 
     if (a->id == b->id) return;  // no self-checks in multigeometries
 
+    // see above, only the shorter line can be covered
+    if (b->length < a->length) std::swap(a, b);
+
     _stats[t].lineCmps++;
     _stats[t].lineLenSum += std::max(a->length, b->length);
 
@@ -3509,7 +5139,7 @@ void Sweeper::doCheck(const JobVal cur, const JobVal sv, size_t t) {
       if (res.first) {
         writeContains(t, b->id, b->subId, a->id, a->subId);
 
-        if (_refs.count(a->id) || a->subId != 0) {
+        if (isReferenced(a->id) || a->subId != 0) {
           writeNotTouches(t, a->id, a->subId, b->id, b->subId);
         }
       } else {
@@ -3523,7 +5153,7 @@ void Sweeper::doCheck(const JobVal cur, const JobVal sv, size_t t) {
 void Sweeper::processQueue(size_t t) {
   try {
     JobBatch batch;
-    while ((batch = _jobs.get()).size()) {
+    while ((batch = _jobs.get(t)).size()) {
       for (const auto& job : batch) {
         if (_cancelled) break;
 
@@ -3546,22 +5176,142 @@ void Sweeper::processQueue(size_t t) {
     std::cerr << ss.str() << std::endl;
     std::exit(1);
   }
+}
+
+// _____________________________________________________________________________
+void Sweeper::startPrefetch() {
+  {
+    std::unique_lock<std::mutex> lock(_prefetchMtx);
+    _prefetchQueue.clear();
+    _prefetchDone = false;
+  }
+
+  _prefetchThr = std::thread(&Sweeper::processPrefetchQueue, this);
+}
+
+// _____________________________________________________________________________
+void Sweeper::stopPrefetch() {
+  {
+    std::unique_lock<std::mutex> lock(_prefetchMtx);
+    _prefetchDone = true;
+  }
+  _prefetchCv.notify_all();
+
+  if (_prefetchThr.joinable()) _prefetchThr.join();
+}
+
+// _____________________________________________________________________________
+std::vector<PrefetchGeom> Sweeper::prefetchGeoms(const JobBatch& batch) const {
+  std::vector<PrefetchGeom> geoms;
+  std::unordered_set<size_t> seen;
+
+  for (const auto& job : batch) {
+    if (!job.multiOut.empty()) continue;
+
+    for (const JobVal* jv : {&job.boxVal, &job.sweepVal}) {
+      // folded geometries are stored in their ids, not in the caches
+      if (jv->type != POLYGON && jv->type != SIMPLE_POLYGON &&
+          jv->type != LINE && jv->type != SIMPLE_LINE && jv->type != POINT)
+        continue;
+
+      if (!seen.insert(jv->id * 16 + jv->type).second) continue;
+      geoms.push_back({jv->id, jv->type, jv->large});
+    }
+  }
 
-  _atomicCurX[t] = _curX[t];
+  return geoms;
 }
 
 // _____________________________________________________________________________
-void Sweeper::fillBatch(
-    JobBatch* batch, const util::geo::IntervalIdx<int32_t, SweepVal>* actives,
-    const BoxVal* cur) const {
-  const auto& overlaps = actives->overlap_find_all({cur->loY, cur->upY});
+void Sweeper::prefetchBatch(int32_t minX, std::vector<PrefetchGeom>&& geoms) {
+  if (geoms.empty()) return;
 
-  for (const auto& p : overlaps) {
+  {
+    std::unique_lock<std::mutex> lock(_prefetchMtx);
+    if (_prefetchQueue.size() >= PREFETCH_MAX_BATCHES) {
+      _prefetchQueue.pop_front();
+    }
+    _prefetchQueue.push_back({minX, std::move(geoms)});
+  }
+  _prefetchCv.notify_one();
+}
+
+// _____________________________________________________________________________
+void Sweeper::processPrefetchQueue() {
+  try {
+    while (true) {
+      std::vector<PrefetchGeom> geoms;
+      int32_t minX;
+
+      {
+        std::unique_lock<std::mutex> lock(_prefetchMtx);
+        _prefetchCv.wait(lock, [this]() {
+          return !_prefetchQueue.empty() || _prefetchDone;
+        });
+        if (_prefetchDone || _cancelled) return;
+        minX = _prefetchQueue.front().first;
+        geoms = std::move(_prefetchQueue.front().second);
+        _prefetchQueue.pop_front();
+      }
+
+      // if the batch is neither queued nor in progress anymore, its
+      // geometries may have been checked and evicted, loading them again
+      // would only pollute the caches. The batch was queued before it was
+      // put here, so it is covered by minPos() until it is done
+      if (minX < _jobs.minPos()) continue;
+
+      // first let the kernel read all geometries of the batch at once, then
+      // decode them in order
+      for (const auto& g : geoms) {
+        if (g.type == POLYGON) {
+          _areaCache.willNeed(g.id);
+        } else if (g.type == SIMPLE_POLYGON) {
+          _simpleAreaCache.willNeed(g.id);
+        } else if (g.type == LINE) {
+          _lineCache.willNeed(g.id);
+        } else if (g.type == SIMPLE_LINE) {
+          _simpleLineCache.willNeed(g.id);
+        } else {
+          _pointCache.willNeed(g.id);
+        }
+      }
+
+      for (const auto& g : geoms) {
+        if (g.type == POLYGON) {
+          _areaCache.prefetch(g.id, g.large);
+        } else if (g.type == SIMPLE_POLYGON) {
+          _simpleAreaCache.prefetch(g.id, g.large);
+        } else if (g.type == LINE) {
+          _lineCache.prefetch(g.id, g.large);
+        } else if (g.type == SIMPLE_LINE) {
+          _simpleLineCache.prefetch(g.id, false);
+        } else {
+          _pointCache.prefetch(g.id, false);
+        }
+      }
+    }
+  } catch (const std::runtime_error& e) {
+    std::stringstream ss;
+    ss << "libspatialjoin: " << e.what();
+    std::cerr << ss.str() << std::endl;
+    std::exit(1);
+  }
+}
+
+// _____________________________________________________________________________
+void Sweeper::fillBatch(JobBatch* batch, const ActiveSet<SweepVal>* actives,
+                        const BoxVal* cur) const {
+  actives->overlaps(cur->loY, cur->upY, [&](const SweepVal& v) {
     // check if diagonal boxes intersect, if not, ignore this pair
-    if (_cfg.useDiagBox && !util::geo::intersects(p.v.b45, cur->b45)) continue;
+    if (_cfg.useDiagBox && !util::geo::intersects(v.b45, cur->b45)) return;
 
     JobVal a(*cur);
-    JobVal b(p.v);
+    JobVal b(v);
+
+    if (_transposed) {
+      untranspose(&a);
+      untranspose(&b);
+    }
 
     // for simple lines, already check if the lines intersect, if not,
     // ignore
@@ -3569,10 +5319,77 @@ void Sweeper::fillBatch(
         !util::geo::IntersectorLine<int32_t>::check(
             LineSegment<int32_t>(a.point, a.point2), 32767, true, 32767, true,
             LineSegment<int32_t>(b.point, b.point2), 32767, true, 32767, true))
-      continue;
+      return;
 
-    batch->push_back({a, b, ""});
-  }
+    batch->push_back({a, b, "", jobCost(a, b)});
+  });
+}
+
+// _____________________________________________________________________________
+void Sweeper::queueBatch(JobBatch&& batch) {
+  // the jobs are reordered below, so they all report the leftmost sweep
+  // position of the batch as the progress of their worker, kept apart from
+  // the checked geometries
+  int32_t minX = batchMinX(batch);
+
+  std::vector<PrefetchGeom> geoms;
+  if (_cfg.prefetch) geoms = prefetchGeoms(batch);
+
+  // the more expensive geometry of each job determines its group, the jobs
+  // of a group are checked in a row, so the geometry stays hot while all its
+  // candidates are checked. All workers share the caches, so the batch is
+  // not split over the workers by group, idle workers steal its chunks
+  auto group = [this](const Job& job) -> const JobVal& {
+    return estimatedAnchors(job.boxVal) > estimatedAnchors(job.sweepVal)
+               ? job.boxVal
+               : job.sweepVal;
+  };
+
+  auto groupKey = [&group](const Job& job) {
+    const JobVal& g = group(job);
+    return std::make_pair(static_cast<uint8_t>(g.type), g.id);
+  };
+
+  for (auto& job : batch) job.pos = minX;
+
+  std::stable_sort(batch.begin(), batch.end(),
+                   [&groupKey](const Job& a, const Job& b) {
+                     return groupKey(a) < groupKey(b);
+                   });
+
+  _jobs.add(std::move(batch), _nextWorker++);
+
+  if (_cfg.prefetch) prefetchBatch(minX, std::move(geoms));
+}
+
+// _____________________________________________________________________________
+size_t Sweeper::estimatedAnchors(const JobVal& jv) const {
+  // for polygons and lines, the x coordinate of point holds the number of
+  // anchor points, except in distance joins
+  if (_cfg.withinDist >= 0) return 0;
+  if (jv.type != POLYGON && jv.type != LINE) return 0;
+  return std::max<int32_t>(0, jv.point.getX());
+}
+
+// _____________________________________________________________________________
+size_t Sweeper::jobCost(const JobVal& a, const JobVal& b) const {
+  // the full geometric check is roughly linear in the number of anchor
+  // points of both geometries
+  return 1 + estimatedAnchors(a) + estimatedAnchors(b);
+}
+
+// _____________________________________________________________________________
+void Sweeper::insertActive(ActiveSet<SweepVal>* actives,
+                           const BoxVal* cur) const {
+  actives[cur->side].insert(
+      cur->loY, cur->upY,
+      {cur->id,
+       cur->type,
+       cur->b45,
+       cur->point,
+       {cur->val, cur->point.getY() == cur->loY ? cur->upY : cur->loY},
+       cur->side,
+       cur->large});
 }
 
 // _____________________________________________________________________________
@@ -3592,31 +5409,16 @@ void Sweeper::writeOverlaps(size_t t, const std::string& a, size_t aSub,
     }
   }
 
-  if (_refs.size() == 0) return;
-
   // handle references
 
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeOverlaps(t, a, aSub, idB.first, idB.second);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeOverlaps(t, a, aSub, idB.first, idB.second);
   }
 
   // no need to check exactly the same direction again
   if (a != b || aSub != bSub) {
-    if (referersA != _refs.end()) {
-      const auto& subs = referersA->second.find(aSub);
-      if (subs != referersA->second.end()) {
-        for (const auto& idA : subs->second) {
-          writeOverlaps(t, idA.first, idA.second, b, bSub);
-        }
-      }
+    for (const auto& idA : referers(a, aSub)) {
+      writeOverlaps(t, idA.first, idA.second, b, bSub);
     }
   }
 }
@@ -3631,29 +5433,14 @@ void Sweeper::writeNotOverlaps(size_t t, const std::string& a, size_t aSub,
     if (aSub != 0) _subNotOverlaps[t][a].insert(b);
   }
 
-  if (_refs.size() == 0) return;
-
   // handle references
 
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeNotOverlaps(t, a, aSub, idB.first, idB.second);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeNotOverlaps(t, a, aSub, idB.first, idB.second);
   }
 
-  if (referersA != _refs.end()) {
-    const auto& subs = referersA->second.find(aSub);
-    if (subs != referersA->second.end()) {
-      for (const auto& idA : subs->second) {
-        writeNotOverlaps(t, idA.first, idA.second, b, bSub);
-      }
-    }
+  for (const auto& idA : referers(a, aSub)) {
+    writeNotOverlaps(t, idA.first, idA.second, b, bSub);
   }
 }
 
@@ -3674,31 +5461,16 @@ void Sweeper::writeCrosses(size_t t, const std::string& a, size_t aSub,
     if (aSub != 0) _subCrosses[t][a].insert(b);
   }
 
-  if (_refs.size() == 0) return;
-
   // handle references
 
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeCrosses(t, a, aSub, idB.first, idB.second);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeCrosses(t, a, aSub, idB.first, idB.second);
   }
 
   // no need to check exactly the same direction again
   if (a != b || aSub != bSub) {
-    if (referersA != _refs.end()) {
-      const auto& subs = referersA->second.find(aSub);
-      if (subs != referersA->second.end()) {
-        for (const auto& idA : subs->second) {
-          writeCrosses(t, idA.first, idA.second, b, bSub);
-        }
-      }
+    for (const auto& idA : referers(a, aSub)) {
+      writeCrosses(t, idA.first, idA.second, b, bSub);
     }
   }
 }
@@ -3713,31 +5485,16 @@ void Sweeper::writeNotCrosses(size_t t, const std::string& a, size_t aSub,
     if (aSub != 0) _subNotCrosses[t][a].insert(b);
   }
 
-  if (_refs.size() == 0) return;
-
   // handle references
 
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeNotCrosses(t, a, aSub, idB.first, idB.second);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeNotCrosses(t, a, aSub, idB.first, idB.second);
   }
 
   // no need to check exactly the same direction again
   if (a != b || aSub != bSub) {
-    if (referersA != _refs.end()) {
-      const auto& subs = referersA->second.find(aSub);
-      if (subs != referersA->second.end()) {
-        for (const auto& idA : subs->second) {
-          writeNotCrosses(t, idA.first, idA.second, b, bSub);
-        }
-      }
+    for (const auto& idA : referers(a, aSub)) {
+      writeNotCrosses(t, idA.first, idA.second, b, bSub);
     }
   }
 }
@@ -3759,31 +5516,16 @@ void Sweeper::writeTouches(size_t t, const std::string& a, size_t aSub,
     if (aSub != 0) _subTouches[t][a].insert(b);
   }
 
-  if (_refs.size() == 0) return;
-
   // handle references
 
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeTouches(t, a, aSub, idB.first, idB.second);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeTouches(t, a, aSub, idB.first, idB.second);
   }
 
   // no need to check exactly the same direction again
   if (a != b || aSub != bSub) {
-    if (referersA != _refs.end()) {
-      const auto& subs = referersA->second.find(aSub);
-      if (subs != referersA->second.end()) {
-        for (const auto& idA : subs->second) {
-          writeTouches(t, idA.first, idA.second, b, bSub);
-        }
-      }
+    for (const auto& idA : referers(a, aSub)) {
+      writeTouches(t, idA.first, idA.second, b, bSub);
     }
   }
 }
@@ -3798,31 +5540,16 @@ void Sweeper::writeNotTouches(size_t t, const std::string& a, size_t aSub,
     if (aSub != 0) _subNotTouches[t][a].insert(b);
   }
 
-  if (_refs.size() == 0) return;
-
   // handle references
 
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeNotTouches(t, a, aSub, idB.first, idB.second);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeNotTouches(t, a, aSub, idB.first, idB.second);
   }
 
   // no need to check exactly the same direction again
   if (a != b || aSub != bSub) {
-    if (referersA != _refs.end()) {
-      const auto& subs = referersA->second.find(aSub);
-      if (subs != referersA->second.end()) {
-        for (const auto& idA : subs->second) {
-          writeNotTouches(t, idA.first, idA.second, b, bSub);
-        }
-      }
+    for (const auto& idA : referers(a, aSub)) {
+      writeNotTouches(t, idA.first, idA.second, b, bSub);
     }
   }
 }
@@ -3847,31 +5574,16 @@ void Sweeper::writeEquals(size_t t, const std::string& a, size_t aSub,
     }
   }
 
-  if (_refs.size() == 0) return;
-
   // handle references
 
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeEquals(t, a, aSub, idB.first, idB.second);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeEquals(t, a, aSub, idB.first, idB.second);
   }
 
   // no need to check exactly the same direction again
   if (a != b || aSub != bSub) {
-    if (referersA != _refs.end()) {
-      const auto& subs = referersA->second.find(aSub);
-      if (subs != referersA->second.end()) {
-        for (const auto& idA : subs->second) {
-          writeEquals(t, idA.first, idA.second, b, bSub);
-        }
-      }
+    for (const auto& idA : referers(a, aSub)) {
+      writeEquals(t, idA.first, idA.second, b, bSub);
     }
   }
 }
@@ -3889,29 +5601,14 @@ void Sweeper::writeCovers(size_t t, const std::string& a, size_t aSub,
     }
   }
 
-  if (_refs.size() == 0) return;
-
   // handle references
 
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeCovers(t, a, aSub, idB.first, idB.second);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeCovers(t, a, aSub, idB.first, idB.second);
   }
 
-  if (referersA != _refs.end()) {
-    const auto& subs = referersA->second.find(aSub);
-    if (subs != referersA->second.end()) {
-      for (const auto& idA : subs->second) {
-        writeCovers(t, idA.first, idA.second, b, bSub);
-      }
-    }
+  for (const auto& idA : referers(a, aSub)) {
+    writeCovers(t, idA.first, idA.second, b, bSub);
   }
 }
 
@@ -3928,29 +5625,14 @@ void Sweeper::writeContains(size_t t, const std::string& a, size_t aSub,
     }
   }
 
-  if (_refs.size() == 0) return;
-
   // handle references
 
-  auto referersA = _refs.find(a);
-  auto referersB = _refs.find(b);
-
-  if (referersB != _refs.end()) {
-    const auto& subs = referersB->second.find(bSub);
-    if (subs != referersB->second.end()) {
-      for (const auto& idB : subs->second) {
-        writeContains(t, a, aSub, idB.first, idB.second);
-      }
-    }
+  for (const auto& idB : referers(b, bSub)) {
+    writeContains(t, a, aSub, idB.first, idB.second);
   }
 
-  if (referersA != _refs.end()) {
-    const auto& subs = referersA->second.find(aSub);
-    if (subs != referersA->second.end()) {
-      for (const auto& idA : subs->second) {
-        writeContains(t, idA.first, idA.second, b, bSub);
-      }
-    }
+  for (const auto& idA : referers(a, aSub)) {
+    writeContains(t, idA.first, idA.second, b, bSub);
   }
 }
 
@@ -12,18 +12,27 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
 #include <functional>
+#include <limits>
 #include <mutex>
 #include <queue>
+#include <set>
+#include <shared_mutex>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
+#include "ActiveSet.h"
+#include "EventSort.h"
+#include "GeomHash.h"
 #include "GeometryCache.h"
+#include "JobScheduler.h"
 #include "Stats.h"
-#include "util/JobQueue.h"
 #include "util/geo/Geo.h"
-#include "util/geo/IntervalIdx.h"
 
 #ifndef POSIX_FADV_SEQUENTIAL
 #define POSIX_FADV_SEQUENTIAL 2
@@ -79,12 +88,92 @@ inline std::string toString(const BoxVal& bv) {
   return ret.str();
 }
 
+// Order-preserving 64 bit sort key of an event. From most to least
+// significant bits: the x coordinate, IN before OUT, the type class (points
+// before lines, everything before polygons), and for lines and polygons the
+// length or area, quantized to the upper 29 bits of its float representation.
+// Distinct areas or lengths may share a key, the checks of two areas or two
+// lines thus do not rely on the smaller one leaving the sweep first.
+inline uint64_t eventKey(const BoxVal& bv) {
+  uint64_t cls = 0;
+  if (bv.type == POINT || bv.type == FOLDED_POINT) {
+    cls = 1;
+  } else if (bv.type == LINE || bv.type == SIMPLE_LINE ||
+             bv.type == FOLDED_SIMPLE_LINE) {
+    cls = 2;
+  } else if (bv.type == POLYGON || bv.type == SIMPLE_POLYGON ||
+             bv.type == FOLDED_BOX_POLYGON) {
+    cls = 3;
+  }
+
+  uint64_t areaOrLen = 0;
+  float f = bv.areaOrLen;
+  if (cls > 1 && f > 0) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(float));
+    areaOrLen = bits >> 3;
+  }
+
+  return (static_cast<uint64_t>(static_cast<uint32_t>(bv.val) ^ 0x80000000u)
+          << 32) |
+         (static_cast<uint64_t>(bv.out) << 31) | (cls << 29) | areaOrLen;
+}
+
+// Compact on-disk representation of a BoxVal. The sort key comes first, the
+// area or length is only stored there. Fields which are not needed for a
+// specific GeomType are folded into shared slots:
+//  - x holds the x coordinate of the event point (for POLYGON and LINE, the
+//    number of anchor points)
+//  - for POINT and FOLDED_POINT, the y coordinate is loY
+//  - for FOLDED_BOX_POLYGON, SIMPLE_LINE and FOLDED_SIMPLE_LINE, the y
+//    coordinate is either loY or upY, depending on the EVENT_UPPER flag
+// The 45 degree rotated bounding box (if diagonal boxes are used) and the
+// explicit y coordinate of the event point (if the bounding boxes are padded)
+// follow the record on disk. If only IN events are written, the right x
+// coordinate of the geometry (and, for padded boxes, the OUT event point) is
+// appended last.
+struct DiskEvent {
+  uint64_t key;
+  int32_t loY;
+  int32_t upY;
+  uint64_t id;
+  int32_t x;
+  uint8_t flags;
+};
+
+const static uint8_t EVENT_OUT = 1;
+const static uint8_t EVENT_SIDE = 1 << 5;
+const static uint8_t EVENT_LARGE = 1 << 6;
+const static uint8_t EVENT_UPPER = 1 << 7;
+
+inline GeomType eventType(const DiskEvent* ev) {
+  return static_cast<GeomType>((ev->flags >> 1) & 0x0F);
+}
+
+inline bool eventOut(const DiskEvent* ev) { return ev->flags & EVENT_OUT; }
+
+inline int32_t eventVal(const DiskEvent* ev) {
+  return static_cast<int32_t>(static_cast<uint32_t>(ev->key >> 32) ^
+                              0x80000000u);
+}
+
+inline double eventAreaOrLen(const DiskEvent* ev) {
+  if (((ev->key >> 29) & 3) < 2) return 0;
+  uint32_t bits = static_cast<uint32_t>(ev->key & 0x1FFFFFFF) << 3;
+  float f;
+  memcpy(&f, &bits, sizeof(float));
+  return f;
+}
+
 struct WriteCand {
   std::string raw;
   std::string gid;
   BoxVal boxvalIn;
   BoxVal boxvalOut;
   size_t subid;
+  GeomHash hash;
+  // the values hashed into hash, compared if the hash matches
+  std::string hashBytes;
 };
 
 struct WriteBatch {
@@ -131,6 +220,92 @@ struct SweepVal {
   bool large;
 };
 
+struct ActiveKey {
+  size_t id;
+  int32_t loY;
+  int32_t upY;
+  GeomType type;
+  bool side;
+};
+
+inline ActiveKey activeKey(const BoxVal& bv) {
+  return {bv.id, bv.loY, bv.upY, bv.type, bv.side};
+}
+
+inline bool operator==(const ActiveKey& a, const ActiveKey& b) {
+  return a.id == b.id && a.loY == b.loY && a.upY == b.upY &&
+         a.type == b.type && a.side == b.side;
+}
+
+struct ActiveKeyHash {
+  size_t operator()(const ActiveKey& k) const {
+    size_t h = std::hash<size_t>()(k.id);
+    h ^= std::hash<int64_t>()((static_cast<int64_t>(k.loY) << 32) ^
+                              static_cast<uint32_t>(k.upY)) +
+         0x9e3779b9 + (h << 6) + (h >> 2);
+    return h ^ (static_cast<size_t>(k.type) << 1) ^ k.side;
+  }
+};
+
+// geometries entering or leaving a sweep stripe
+struct StripeBorder {
+  // IN events of geometries still active at the end of the stripe
+  std::vector<BoxVal> open;
+
+  // OUT events of geometries which became active in a previous stripe
+  std::vector<BoxVal> closed;
+
+  // multi geometries started in this stripe
+  std::vector<std::pair<bool, size_t>> multis;
+
+  // if only IN events are stored, the restored OUT events of the geometries
+  // in open
+  std::vector<BoxVal> openOut;
+};
+
+// state of the duplicate removal, carried over between the buckets of the
+// sorted events file, or between the events of the sweep
+struct DuplicateState {
+  // the offsets in the area and the line cache overlap, so the sets below
+  // are keyed on both the type and the offset
+  static size_t key(GeomType type, size_t id) { return id * 16 + type; }
+
+  // geometries whose OUT event has to be dropped, unused if only IN events
+  // are stored
+  std::unordered_set<size_t> deleted;
+
+  // geometries referenced by a duplicate in the current equal-X block
+  std::unordered_set<size_t> referenced;
+
+  std::unordered_map<uint64_t, std::pair<size_t, bool>> duplicatePolys,
+      duplicateLines;
+
+  int32_t curX = 0;
+  size_t jj = 0;
+};
+
+// an OUT event restored from its IN event, waiting to be swept
+struct PendingOut {
+  uint64_t key;
+  BoxVal bv;
+};
+
+inline bool operator>(const PendingOut& a, const PendingOut& b) {
+  return a.key > b.key;
+}
+
+typedef std::priority_queue<PendingOut, std::vector<PendingOut>,
+                            std::greater<PendingOut>>
+    OutHeap;
+
+// a geometry whose OUT event has been swept, it can be evicted from its
+// cache once all workers have moved past x
+struct RetiredGeom {
+  int32_t x;
+  GeomType type;
+  size_t id;
+};
+
 struct JobVal {
   size_t id;
   GeomType type : 4;
@@ -170,6 +345,10 @@ inline bool operator<(const SweepVal& a, const SweepVal& b) {
 struct Job {
   JobVal boxVal, sweepVal;
   std::string multiOut;
+  // estimated cost of the check
+  size_t cost = 1;
+  // sweep position reported as the progress of the worker running the job
+  int32_t pos = std::numeric_limits<int32_t>::min();
 };
 
 inline bool operator==(const Job& a, const Job& b) {
@@ -179,8 +358,30 @@ inline bool operator==(const Job& a, const Job& b) {
 
 typedef std::vector<Job> JobBatch;
 
+// a cached geometry referenced by a queued batch
+struct PrefetchGeom {
+  size_t id;
+  GeomType type;
+  bool large;
+};
+
+struct JobCost {
+  size_t operator()(const Job& job) const { return job.cost; }
+};
+
+// multi outputs don't check geometries and hold back nothing
+struct JobPos {
+  int32_t operator()(const Job& job) const {
+    return job.multiOut.empty() ? job.pos
+                                : std::numeric_limits<int32_t>::max();
+  }
+};
+
 typedef std::tuple<bool, bool, bool, bool, bool> GeomCheckRes;
 
+// axis along which the events are swept
+enum SweepAxis : uint8_t { SWEEP_X = 0, SWEEP_Y = 1, SWEEP_AUTO = 2 };
+
 struct SweeperCfg {
   size_t numThreads;
   size_t numCacheThreads;
@@ -209,19 +410,88 @@ struct SweeperCfg {
   std::function<void(const std::string&)> statsCb;
   std::function<void(size_t)> sweepProgressCb;
   std::function<void()> sweepCancellationCb;
+  // if > 1, split the sweep into this many x-stripes, which are swept
+  // concurrently
+  size_t numSweepStripes = 1;
+  // sort the events in memory if they take up at most this many bytes,
+  // otherwise, they are spilled to disk in sorted runs of this size (but of
+  // at least EVENT_SORT_MIN_RUN_EVENTS events), 0 = EVENT_SORT_RUN_SIZE
+  size_t sortMemBudget = 0;
+  // only store the IN event of each geometry, OUT events are restored from
+  // it during the sweep
+  bool singleEvents = false;
+  // record the x range of every geometry, required for delta joins against
+  // a dataset stored with storePrepared()
+  bool recordXRanges = false;
+  // collapse geometries with equal content into references at parse time,
+  // before they are written to the geometry caches or the events. Equal
+  // hashes are confirmed by comparing the hashed coordinates
+  bool hashDuplicates = false;
+  // sweep along x or y, SWEEP_AUTO picks the axis with the smaller expected
+  // number of active geometries, estimated from the first added geometries
+  SweepAxis sweepAxis = SWEEP_X;
+  // eviction policy of the geometry caches
+  CachePolicy geomCachePolicy = CACHE_LRU;
+  // geometries of a type are kept in memory, bypassing the caches, until
+  // their serialized size exceeds this
+  size_t geomMemStoreMaxSize = MAX_MEM_CACHE_SIZE;
+  // evict geometries from the caches as soon as their OUT event has been
+  // swept and all their checks are done, only used with a single stripe.
+  // Checks hold the geometries they read as shared_ptrs, so an early
+  // eviction never invalidates a geometry in use, it only costs a re-read
+  bool evictRetired = false;
+  // load the geometries of queued batches into the caches in a separate
+  // thread, before the workers get to them
+  bool prefetch = false;
+  // if the events were spilled in several runs, merge them during the
+  // sweep, which starts on the first merged key range while the later ones
+  // are still being merged. Only used with a single stripe. storePrepared()
+  // and sweepDeltaAdded() still merge all runs before they start
+  bool pipelineSweep = false;
 };
 
-// buffer size _must_ be multiples of sizeof(BoxVal)
+// maximum buffer size, at least sizeof(BoxVal) * 64 * 1024 * 512 encoded
+// events fit
 static const ssize_t BUFFER_S = sizeof(BoxVal) * 64 * 1024 * 512;
 
 static const size_t MAX_OUT_LINE_LENGTH = 1000;
 
-static const size_t POINT_CACHE_MAX_ELEMENTS = 10000;
-static const size_t SIMPLE_LINE_CACHE_MAX_ELEMENTS = 10000;
+// shared by all threads, like the geometry cache budgets
+static const size_t POINT_CACHE_MAX_ELEMENTS = 100000;
+static const size_t SIMPLE_LINE_CACHE_MAX_ELEMENTS = 100000;
 
 // only use large geom cache for extreme geometries
 static const size_t GEOM_LARGENESS_THRESHOLD = 1024 * 1024 * 1024;
 
+// a batch of check jobs is shipped once its estimated cost exceeds this
+static const size_t JOB_BATCH_MAX_COST = 2000000;
+
+// maximum estimated cost of the queued check jobs, the sweep blocks beyond
+// that
+static const size_t JOB_QUEUE_MAX_COST = 100 * JOB_BATCH_MAX_COST;
+
+// number of geometries whose bounding boxes are sampled to choose the sweep
+// axis, their batches are held back until the axis has been chosen
+static const size_t AXIS_SAMPLE_SIZE = 10000;
+
+// the y axis is only chosen if it is expected to shrink the active sets by at
+// least this factor
+static const double AXIS_SWITCH_FACTOR = 1.5;
+
+// the retired geometries are evicted from the caches every this many events
+static const size_t RETIRE_EVICT_INTERVAL = 10000;
+
+// maximum number of batches waiting for the prefetcher, beyond that the
+// oldest ones are dropped, as the workers are likely already at them
+static const size_t PREFETCH_MAX_BATCHES = 64;
+
+// phase of a delta join against a prepared dataset
+enum DeltaMode : uint8_t {
+  DELTA_NONE = 0,
+  DELTA_ADDED = 1,
+  DELTA_RETRACTED = 2
+};
+
 class Sweeper {
  public:
   Sweeper(SweeperCfg cfg, const std::string& cache)
@@ -229,27 +499,49 @@ class Sweeper {
   Sweeper(SweeperCfg cfg, const std::string& cache,
           const std::string& tmpPrefix)
       : _cfg(cfg),
+        _eventSize(sizeof(DiskEvent) +
+                   (cfg.useDiagBox ? 4 * sizeof(int32_t) : 0) +
+                   (cfg.withinDist >= 0 ? 2 * sizeof(int32_t) : 0) +
+                   (cfg.singleEvents
+                        ? (cfg.withinDist >= 0 ? 4 : 2) * sizeof(int32_t)
+                        : 0)),
+        _runSize(std::min<size_t>(
+                     BUFFER_S,
+                     cfg.sortMemBudget
+                         ? std::max(EVENT_SORT_MIN_RUN_EVENTS * _eventSize,
+                                    cfg.sortMemBudget)
+                         : EVENT_SORT_RUN_SIZE) /
+                 _eventSize * _eventSize),
         _obufpos(0),
         _pointCache({cfg.useOBB, cfg.useInnerOuter}, cfg.geomCacheMaxSize,
-                    POINT_CACHE_MAX_ELEMENTS, cfg.numCacheThreads, cache,
-                    tmpPrefix),
+                    POINT_CACHE_MAX_ELEMENTS, cfg.geomCachePolicy,
+                    cfg.numCacheThreads, cache, tmpPrefix),
         _areaCache({cfg.useOBB, cfg.useInnerOuter}, cfg.geomCacheMaxSize,
-                   cfg.geomCacheMaxNumElements, cfg.numCacheThreads, cache,
-                   tmpPrefix),
+                   cfg.geomCacheMaxNumElements, cfg.geomCachePolicy,
+                   cfg.numCacheThreads, cache, tmpPrefix),
         _simpleAreaCache({cfg.useOBB, cfg.useInnerOuter}, cfg.geomCacheMaxSize,
-                         cfg.geomCacheMaxNumElements, cfg.numCacheThreads,
-                         cache, tmpPrefix),
+                         cfg.geomCacheMaxNumElements, cfg.geomCachePolicy,
+                         cfg.numCacheThreads, cache, tmpPrefix),
         _lineCache({cfg.useOBB, cfg.useInnerOuter}, cfg.geomCacheMaxSize,
-                   cfg.geomCacheMaxNumElements, cfg.numCacheThreads, cache,
-                   tmpPrefix),
+                   cfg.geomCacheMaxNumElements, cfg.geomCachePolicy,
+                   cfg.numCacheThreads, cache, tmpPrefix),
         _simpleLineCache({cfg.useOBB, cfg.useInnerOuter}, cfg.geomCacheMaxSize,
-                         SIMPLE_LINE_CACHE_MAX_ELEMENTS, cfg.numCacheThreads,
-                         cache, tmpPrefix),
+                         SIMPLE_LINE_CACHE_MAX_ELEMENTS, cfg.geomCachePolicy,
+                         cfg.numCacheThreads, cache, tmpPrefix),
         _cache(cache),
-        _jobs(100) {
+        _jobs(cfg.numThreads, JOB_QUEUE_MAX_COST) {
     if (!_cfg.writeRelCb) {
     }
 
+    _pointCache.MEM_STORE_MAX_SIZE = _cfg.geomMemStoreMaxSize;
+    _areaCache.MEM_STORE_MAX_SIZE = _cfg.geomMemStoreMaxSize;
+    _simpleAreaCache.MEM_STORE_MAX_SIZE = _cfg.geomMemStoreMaxSize;
+    _lineCache.MEM_STORE_MAX_SIZE = _cfg.geomMemStoreMaxSize;
+    _simpleLineCache.MEM_STORE_MAX_SIZE = _cfg.geomMemStoreMaxSize;
+
+    _transposed = _cfg.sweepAxis == SWEEP_Y;
+    _axisChosen = _cfg.sweepAxis != SWEEP_AUTO;
+
     // OUTFACTOR 1
     _fname = util::getTmpFName(_cache, tmpPrefix, "events");
     _file = open(_fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
@@ -261,16 +553,45 @@ class Sweeper {
     // immediately unlink
     unlink(_fname.c_str());
 
+    if (_cfg.recordXRanges) {
+      std::string xFName = util::getTmpFName(_cache, tmpPrefix, "xranges");
+      _xRangesF.open(xFName, std::ios::in | std::ios::out | std::ios::binary |
+                                 std::ios::trunc);
+
+      if (!_xRangesF.good()) {
+        throw std::runtime_error("Could not open temporary file " + xFName);
+      }
+
+      unlink(xFName.c_str());
+    }
+
+    if (_cfg.hashDuplicates) {
+      std::string hFName = util::getTmpFName(_cache, tmpPrefix, "hashes");
+      _hashFile = open(hFName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+      if (_hashFile < 0) {
+        throw std::runtime_error("Could not open temporary file " + hFName);
+      }
+
+      unlink(hFName.c_str());
+    }
+
 #ifdef __unix__
     posix_fadvise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
 
     // OUTFACTOR 1
 
-    _outBuffer = new unsigned char[BUFFER_S];
+    _outBuffer = new unsigned char[_runSize];
   };
 
-  ~Sweeper() { close(_file); }
+  ~Sweeper() {
+    if (_spillThr.joinable()) _spillThr.join();
+    close(_file);
+    if (_mergeRunFile >= 0) close(_mergeRunFile);
+    if (_baseFile >= 0) close(_baseFile);
+    if (_hashFile >= 0) close(_hashFile);
+  }
 
   void log(const std::string& msg);
 
@@ -318,9 +639,41 @@ class Sweeper {
 
   void flush();
 
+  // durably store the flushed events, geometries and join metadata in
+  // directory dir, so later runs can skip parsing and sorting. The stored
+  // events are sorted and deduplicated
+  void storePrepared(const std::string& dir);
+
+  // load a dataset stored by storePrepared(), instead of adding geometries
+  // and calling flush(). If delta is set, the dataset is the base of a delta
+  // join: geometries added afterwards on side 1 are the added or modified
+  // ones, and are flushed as usual
+  void loadPrepared(const std::string& dir, bool delta);
+  void loadPrepared(const std::string& dir) { loadPrepared(dir, false); }
+
+  // ids of the geometries added on top of a delta base
+  const std::unordered_set<std::string>& deltaIds() const { return _deltaIds; }
+
+  // sweep only the x ranges of the geometries added on top of a delta base,
+  // and write their relations with each other and with the base geometries
+  // whose ids are not in changed
+  RelStats sweepDeltaAdded(const std::unordered_set<std::string>& changed);
+
+  // sweep only the x ranges of the loaded geometries whose ids are in
+  // changed, and write all their relations
+  RelStats sweepDeltaRetracted(const std::unordered_set<std::string>& changed);
+
   RelStats sweep();
 
-  size_t numElements() const { return _curSweepId / 2; }
+  size_t numElements() const { return _curSweepId / eventsPerGeom(); }
+
+  // number of sorted runs the events were spilled in, 0 if they were sorted
+  // in memory
+  size_t numSortRuns() const { return _runs.size() - 1; }
+
+  size_t numRetiredEvicted() const { return _numRetiredEvicted; }
+
+  bool transposed() const { return _transposed; }
 
   size_t numReferences() const {
     size_t ret = 0;
@@ -398,15 +751,24 @@ class Sweeper {
 
  private:
   const SweeperCfg _cfg;
+  const size_t _eventSize;
+  const size_t _runSize;
   size_t _curSweepId = 0;
   std::string _fname;
   int _file;
   unsigned char* _outBuffer;
   ssize_t _obufpos;
 
+  // boundaries of the sorted runs in the events file, in events
+  std::vector<size_t> _runs = {0};
+  std::thread _spillThr;
+  std::exception_ptr _spillExc;
+
+  // sorted runs left to be merged by a pipelined sweep, in _mergeRunFile
+  int _mergeRunFile = -1;
+  std::vector<size_t> _mergeRuns;
+
   std::vector<size_t> _checks;
-  std::vector<int32_t> _curX;
-  std::vector<std::atomic<int32_t>> _atomicCurX;
   std::atomic<bool> _cancelled;
 
   std::vector<RelStats> _relStats;
@@ -439,6 +801,18 @@ class Sweeper {
   std::map<std::string, size_t> _subSizes;
 
   std::set<size_t> _activeMultis[2];
+
+  // swept geometries not yet evicted from the caches, in sweep order
+  std::deque<RetiredGeom> _retired;
+  size_t _numRetiredEvicted = 0;
+
+  std::atomic<size_t> _numSwept;
+  std::mutex _sweepCbMtx;
+
+  // per stripe, a lower bound for the x of the jobs it has not yet queued,
+  // INT32_MAX once it is done. Only one stripe clears multis at a time
+  std::vector<std::atomic<int32_t>> _stripeX;
+  std::mutex _stripeMultisMtx;
   std::vector<std::string> _multiIds[2];
   std::vector<int32_t> _multiRightX[2];
   std::vector<int32_t> _multiLeftX[2];
@@ -446,7 +820,18 @@ class Sweeper {
 
   std::string _cache;
 
-  util::JobQueue<JobBatch> _jobs;
+  JobScheduler<Job, JobCost, JobPos> _jobs;
+
+  // the queued batches are spread round-robin over the workers
+  std::atomic<size_t> _nextWorker{0};
+
+  // leftmost sweep position and geometries of the queued batches, waiting
+  // for the prefetcher
+  std::deque<std::pair<int32_t, std::vector<PrefetchGeom>>> _prefetchQueue;
+  std::mutex _prefetchMtx;
+  std::condition_variable _prefetchCv;
+  bool _prefetchDone = false;
+  std::thread _prefetchThr;
 
   uint8_t _numSides = 1;
 
@@ -519,12 +904,40 @@ class Sweeper {
   double getMaxScaleFactor(const util::geo::I32Box& geom) const;
   double getMaxScaleFactor(const util::geo::I32Point& geom) const;
 
-  void diskAdd(const BoxVal& bv);
+  void diskAdd(const BoxVal& bv, const BoxVal* out = 0);
+  void diskAdd(const BoxVal& in, const BoxVal& out);
+
+  size_t eventsPerGeom() const { return _cfg.singleEvents ? 1 : 2; }
+
+  std::string preparedFingerprint() const;
+  void recordXRange(const WriteCand& cand, bool ref);
+  void removeHashDuplicates(std::vector<WriteCand>* cands, GeomType type);
+  void writeHashParent(const WriteCand& cand);
+  bool readHashParent(size_t off, const WriteCand& cand,
+                      std::pair<std::string, size_t>* parent) const;
+  void writeBatch(WriteBatch& cands);
+  void sampleAxis(const WriteBatch& cands);
+  void chooseAxis();
+  void transpose(WriteCand* cand, bool ref) const;
+  void untranspose(JobVal* jv) const;
+  ssize_t copyEvents(int in, int out, size_t from, size_t to) const;
+  size_t eventIndexAt(int file, size_t numEvents, int32_t x) const;
+  int64_t readXRanges(const std::unordered_set<std::string>* changed,
+                      std::vector<std::pair<int32_t, int32_t>>* ranges) const;
+  size_t writeDeltaWindows(int in, size_t numEvents,
+                           std::vector<std::pair<int32_t, int32_t>> ranges,
+                           int64_t width, int out);
+  int openTmpEvents();
+
+  bool removeDuplicate(BoxVal* cur, DuplicateState* state);
+  std::vector<std::pair<std::string, size_t>> referers(const std::string& gid,
+                                                       size_t sub) const;
+  bool isReferenced(const std::string& gid) const;
 
   void multiOut(size_t t, const std::string& gid);
   void multiAdd(const std::string& gid, bool side, int32_t xLeft,
                 int32_t xRight);
-  void clearMultis(bool force);
+  void clearMultis(bool force, int32_t bound);
 
   void writeIntersect(size_t t, const std::string& a, size_t aSub,
                       const std::string& b, size_t bSub);
@@ -560,7 +973,13 @@ class Sweeper {
   void doDistCheck(JobVal cur, JobVal sv, size_t t);
   void doDE9IMCheck(JobVal cur, JobVal sv, size_t t);
   void selfCheck(const std::string& a, size_t subId, GeomType type, size_t t);
+  void selfCheck(size_t id, GeomType type, size_t t);
   void processQueue(size_t t);
+  void startPrefetch();
+  void stopPrefetch();
+  std::vector<PrefetchGeom> prefetchGeoms(const JobBatch& batch) const;
+  void prefetchBatch(int32_t minX, std::vector<PrefetchGeom>&& geoms);
+  void processPrefetchQueue();
 
   bool notOverlaps(const std::string& a, const std::string& b);
   bool notTouches(const std::string& a, const std::string& b);
@@ -588,74 +1007,59 @@ class Sweeper {
   static double meterDist(const util::geo::I32Point& p1,
                           const util::geo::I32Point& p2);
 
-  void fillBatch(JobBatch* batch,
-                 const util::geo::IntervalIdx<int32_t, SweepVal>* actives,
+  void fillBatch(JobBatch* batch, const ActiveSet<SweepVal>* actives,
                  const BoxVal* cur) const;
+  size_t estimatedAnchors(const JobVal& jv) const;
+  size_t jobCost(const JobVal& a, const JobVal& b) const;
+  void queueBatch(JobBatch&& batch);
 
-  void duplicatesToReferences();
+  void insertActive(ActiveSet<SweepVal>* actives, const BoxVal* cur) const;
 
-  static int boxCmp(const void* a, const void* b) {
-    const auto& boxa = static_cast<const BoxVal*>(a);
-    const auto& boxb = static_cast<const BoxVal*>(b);
-    if (boxa->val < boxb->val) return -1;
-    if (boxa->val > boxb->val) return 1;
-
-    if (!boxa->out && boxb->out) return -1;
-    if (boxa->out && !boxb->out) return 1;
-
-    // everything before a polygon
-    if (boxa->type != POLYGON && boxa->type != SIMPLE_POLYGON &&
-        boxa->type != FOLDED_BOX_POLYGON &&
-        (boxb->type == POLYGON || boxb->type == SIMPLE_POLYGON ||
-         boxb->type == FOLDED_BOX_POLYGON))
-      return -1;
-    if ((boxa->type == POLYGON || boxa->type == SIMPLE_POLYGON ||
-         boxa->type == FOLDED_BOX_POLYGON) &&
-        boxb->type != POLYGON && boxb->type != SIMPLE_POLYGON &&
-        boxb->type != FOLDED_BOX_POLYGON)
-      return 1;
-
-    // points before lines
-    if ((boxa->type == POINT || boxa->type == FOLDED_POINT) &&
-        (boxb->type == SIMPLE_LINE || boxb->type == LINE ||
-         boxb->type == FOLDED_SIMPLE_LINE))
-      return -1;
-    if ((boxb->type == POINT || boxb->type == FOLDED_POINT) &&
-        (boxa->type == SIMPLE_LINE || boxa->type == LINE ||
-         boxa->type == FOLDED_SIMPLE_LINE))
-      return 1;
-
-    // smaller polygons before larger
-    if ((boxa->type == POLYGON || boxa->type == SIMPLE_POLYGON ||
-         boxa->type == FOLDED_BOX_POLYGON) &&
-        (boxb->type == POLYGON || boxb->type == SIMPLE_POLYGON ||
-         boxb->type == FOLDED_BOX_POLYGON) &&
-        boxa->areaOrLen < boxb->areaOrLen)
-      return -1;
-    if ((boxa->type == POLYGON || boxa->type == SIMPLE_POLYGON ||
-         boxa->type == FOLDED_BOX_POLYGON) &&
-        (boxb->type == POLYGON || boxb->type == SIMPLE_POLYGON ||
-         boxb->type == FOLDED_BOX_POLYGON) &&
-        boxa->areaOrLen > boxb->areaOrLen)
-      return 1;
-
-    // shorter lines before longer
-    if ((boxa->type == LINE || boxa->type == SIMPLE_LINE ||
-         boxa->type == FOLDED_SIMPLE_LINE) &&
-        (boxb->type == LINE || boxb->type == SIMPLE_LINE ||
-         boxb->type == FOLDED_SIMPLE_LINE) &&
-        boxa->areaOrLen < boxb->areaOrLen)
-      return -1;
-    if ((boxa->type == LINE || boxa->type == SIMPLE_LINE ||
-         boxa->type == FOLDED_SIMPLE_LINE) &&
-        (boxb->type == LINE || boxb->type == SIMPLE_LINE ||
-         boxb->type == FOLDED_SIMPLE_LINE) &&
-        boxa->areaOrLen > boxb->areaOrLen)
-      return 1;
-
-    return 0;
+  static bool isSelfCheck(GeomType gt) {
+    return gt == SELF_CHECK || gt == SELF_CHECK_AREA ||
+           gt == SELF_CHECK_LINE || gt == SELF_CHECK_POINT;
   }
 
+  static bool isMultiIn(const BoxVal* bv) {
+    return !bv->out && bv->loY == 1 && bv->upY == 0 && bv->type == POINT;
+  }
+
+  void sweepOut(const BoxVal* cur, ActiveSet<SweepVal>* actives,
+                JobBatch* curBatch, size_t* batchCost, size_t batchSize,
+                size_t* counts, size_t* checkPairs);
+  void sweepOuts(OutHeap* outs, uint64_t upTo, ActiveSet<SweepVal>* actives,
+                 JobBatch* curBatch, size_t* batchCost, size_t batchSize,
+                 size_t* counts, size_t* checkPairs);
+
+  void sweepStripes(size_t batchSize, size_t* counts, size_t* checkPairs);
+  void scanStripe(size_t from, size_t to, uint64_t toKey, StripeBorder* border,
+                  std::exception_ptr* exc);
+  void sweepStripe(size_t stripe, size_t from, size_t to, uint64_t toKey,
+                   const std::vector<BoxVal>* carry,
+                   const std::vector<BoxVal>* carryOut, size_t batchSize,
+                   size_t* counts, size_t* checkPairs, std::exception_ptr* exc);
+
+  void duplicatesToReferences();
+  void duplicatesToReferences(size_t from, size_t to, DuplicateState* state);
+  void sortInMemory();
+  void sortExternal(bool pipelined);
+  void mergeRuns(const std::function<void(size_t, size_t)>& bucketCb);
+  void finishMerge();
+  void spillRun();
+  void writeRun(unsigned char* run, size_t numEvents);
+  void waitForRun();
+
+  void encodeEvent(const BoxVal& bv, unsigned char* buf) const;
+  BoxVal decodeEvent(const unsigned char* buf) const;
+  void encodeOutEvent(const BoxVal* out, unsigned char* buf) const;
+  BoxVal decodeOutEvent(const BoxVal& in, const unsigned char* buf) const;
+  size_t outEventOffset() const;
+
+  void retire(const BoxVal& cur);
+  void evictRetired(int32_t bound);
+  static int32_t batchMinX(const JobBatch& batch);
+  std::string cacheStats() const;
+
   mutable std::mutex _multiAddMtx;
   mutable std::mutex _sweepEventWriteMtx;
   mutable std::mutex _pointGeomCacheWriteMtx;
@@ -673,6 +1077,55 @@ class Sweeper {
 
   std::vector<std::pair<std::string, size_t>> _selfChecks;
 
+  // guards _refs and _selfChecks, to which duplicates found during the sweep
+  // are added
+  mutable std::shared_timed_mutex _refsMtx;
+
+  // offset in _hashFile of the first geometry with a content hash, per side
+  std::unordered_map<GeomHash, size_t, GeomHashHash> _geomHashes[2];
+
+  // id, sub id and hashed values of the first geometry per content hash, kept
+  // on disk and only read back if a later geometry has the same hash
+  int _hashFile = -1;
+  size_t _hashFileSize = 0;
+
+  // referenced geometries whose self checks were written at parse time
+  std::set<std::pair<std::string, size_t>> _hashRefs;
+
+  // if set, the events are swept along y: the x and y coordinates of their
+  // boxes and points are swapped, the cached geometries are left untouched
+  bool _transposed = false;
+
+  // batches held back until the sweep axis has been chosen, and the summed
+  // widths and heights and the bounding box of their geometries
+  std::atomic<bool> _axisChosen{true};
+  std::mutex _axisMtx;
+  std::vector<WriteBatch> _axisSample;
+  size_t _axisSampleSize = 0;
+  double _axisSampleW = 0;
+  double _axisSampleH = 0;
+  util::geo::I32Box _axisSampleBox;
+
+  // directory of the loaded prepared dataset
+  std::string _preparedDir;
+
+  // duplicates were already turned into references in the events file,
+  // otherwise, this is done during the sweep
+  bool _duplicatesRemoved = false;
+
+  // x ranges of the added geometries, if recorded, and their max. width
+  std::fstream _xRangesF;
+  int64_t _maxXWidth = 0;
+
+  // delta joins, the base events are kept in _baseFile
+  DeltaMode _deltaMode = DELTA_NONE;
+  bool _deltaBase = false;
+  int _baseFile = -1;
+  size_t _baseSweepId = 0;
+  std::unordered_set<std::string> _deltaIds;
+  std::vector<std::pair<int32_t, int32_t>> _deltaXRanges;
+  std::unordered_set<std::string> _changed;
+
   util::geo::I32Box _filterBox = {{std::numeric_limits<int32_t>::lowest(),
                                    std::numeric_limits<int32_t>::lowest()},
                                   {std::numeric_limits<int32_t>::max(),
@@ -1,11 +1,18 @@
 // Copyright 2024
 // Author: Patrick Brosi
 
+#include <algorithm>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <regex>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "spatialjoin/BoxIds.h"
+#include "spatialjoin/GeometryCache.h"
 #include "spatialjoin/OutputWriter.h"
 #include "spatialjoin/Sweeper.h"
 #include "spatialjoin/WKTParse.h"
@@ -20,13 +27,41 @@ size_t NUM_THREADS = 1;
 
 struct RunStats {
   size_t numReferences;
+  size_t numSortRuns = 0;
+  size_t numRetiredEvicted = 0;
+  bool transposed = false;
 };
 
+// _____________________________________________________________________________
+void removePrepared(const std::string& dir) {
+  for (auto f : {"events", "points", "areas", "simpleareas", "lines",
+                 "simplelines", "meta", "xranges"}) {
+    unlink((dir + "/" + f).c_str());
+  }
+  rmdir(dir.c_str());
+}
+
+// _____________________________________________________________________________
+void parseFile(Sweeper* sweeper, const std::string& file, bool side) {
+  const static size_t BUFF_SIZE = 100;
+  char buf[BUFF_SIZE];
+  ssize_t len = 0;
+
+  int f = open(file.c_str(), O_RDONLY);
+  TEST(f >= 0);
+
+  sj::WKTParser parser(sweeper, 1);
+  while ((len = read(f, buf, BUFF_SIZE)) > 0) parser.parse(buf, len, side);
+  parser.done();
+
+  close(f);
+}
+
 // _____________________________________________________________________________
 std::string fullRun(const std::string& file, sj::SweeperCfg cfg,
-                    RunStats* stats) {
+                    RunStats* stats, const std::string& prepareDir = "") {
   {
-    sj::OutputWriter outWriter(NUM_THREADS, "$", "$\n", ".resTmp", ".");
+    sj::OutputWriter outWriter(cfg.numThreads, "$", "$\n", ".resTmp", ".");
     cfg.writeRelCb = [&outWriter](size_t t, const char* a, size_t an,
                                   const char* b, size_t bn, const char* pred,
                                   size_t predn) {
@@ -55,10 +90,23 @@ std::string fullRun(const std::string& file, sj::SweeperCfg cfg,
     delete[] buf;
 
     sweeper.flush();
-
-    sweeper.sweep();
-
-    stats->numReferences = sweeper.numReferences();
+    stats->numSortRuns = sweeper.numSortRuns();
+    stats->transposed = sweeper.transposed();
+
+    if (prepareDir.empty()) {
+      sweeper.sweep();
+      stats->numReferences = sweeper.numReferences();
+      stats->numRetiredEvicted = sweeper.numRetiredEvicted();
+    } else {
+      // join on a fresh sweeper, loaded from the prepared dataset
+      sweeper.storePrepared(prepareDir);
+      Sweeper loaded(cfg, ".");
+      loaded.loadPrepared(prepareDir);
+      loaded.sweep();
+      stats->numReferences = loaded.numReferences();
+
+      removePrepared(prepareDir);
+    }
 
     close(f);
   }
@@ -75,8 +123,271 @@ std::string fullRun(const std::string& file, sj::SweeperCfg cfg,
   return ss.str();
 }
 
+// _____________________________________________________________________________
+void deltaRun(const std::string& baseFile, const std::string& deltaFile,
+              const std::vector<std::string>& deleted, sj::SweeperCfg cfg,
+              std::set<std::string>* added, std::set<std::string>* retracted) {
+  {
+    sj::OutputWriter outWriter(NUM_THREADS, "$", "$\n", ".resTmp", ".");
+    cfg.writeRelCb = [&outWriter](size_t t, const char* a, size_t an,
+                                  const char* b, size_t bn, const char* pred,
+                                  size_t predn) {
+      outWriter.writeRelCb(t, a, an, b, bn, pred, predn);
+    };
+
+    {
+      sj::SweeperCfg prepCfg = cfg;
+      prepCfg.recordXRanges = true;
+      Sweeper base(prepCfg, ".");
+      base.DUPLICATE_REMOVAL_MIN_SIZE = 0;
+      parseFile(&base, baseFile, 0);
+      base.flush();
+      base.storePrepared(".deltaTest");
+    }
+
+    Sweeper sweeper(cfg, ".");
+    sweeper.DUPLICATE_REMOVAL_MIN_SIZE = 0;
+    sweeper.loadPrepared(".deltaTest", true);
+    parseFile(&sweeper, deltaFile, 1);
+    sweeper.flush();
+
+    auto changed = sweeper.deltaIds();
+    for (const auto& id : deleted) changed.insert(sj::idEnhance(id));
+
+    {
+      Sweeper old(cfg, ".");
+      old.loadPrepared(".deltaTest");
+      outWriter.setPrefix("-$");
+      old.sweepDeltaRetracted(changed);
+    }
+
+    outWriter.setPrefix("+$");
+    sweeper.sweepDeltaAdded(changed);
+  }
+
+  removePrepared(".deltaTest");
+
+  std::ifstream ifs(".resTmp");
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (line[0] == '+') added->insert(line.substr(1));
+    if (line[0] == '-') retracted->insert(line.substr(1));
+  }
+
+  ifs.close();
+  unlink(".resTmp");
+}
+
+// _____________________________________________________________________________
+std::vector<std::string> sortedLines(const std::string& res) {
+  std::vector<std::string> ret;
+  std::stringstream ss(res);
+  std::string line;
+  while (std::getline(ss, line)) ret.push_back(line);
+  std::sort(ret.begin(), ret.end());
+  return ret;
+}
+
+// _____________________________________________________________________________
+std::vector<std::pair<RunStats, RunStats>> compareRuns(
+    const std::vector<sj::SweeperCfg>& cfgs,
+    const std::vector<std::string>& datasets,
+    const std::function<void(sj::SweeperCfg*)>& change) {
+  // every dataset is joined with every config, as given and modified by
+  // change, which must not change the result
+  std::vector<std::pair<RunStats, RunStats>> ret;
+
+  for (const auto& cfg : cfgs) {
+    sj::SweeperCfg changed = cfg;
+    change(&changed);
+
+    for (const auto& dataset : datasets) {
+      RunStats stats, changedStats;
+      auto res = fullRun(dataset, cfg, &stats);
+      auto changedRes = fullRun(dataset, changed, &changedStats);
+
+      TEST(sortedLines(changedRes) == sortedLines(res));
+      ret.push_back({stats, changedStats});
+    }
+  }
+
+  return ret;
+}
+
+// _____________________________________________________________________________
+std::vector<size_t> addPoints(sj::GeometryCache<sj::Point>* cache, size_t n,
+                              size_t idLen) {
+  std::vector<size_t> offs;
+  for (size_t i = 0; i < n; i++) {
+    std::string id = "p" + std::to_string(i);
+    id.resize(std::max(idLen, id.size()), '_');
+
+    std::stringstream ss;
+    cache->writeTo(sj::Point{id, i}, ss);
+    offs.push_back(cache->add(ss.str()));
+  }
+
+  return offs;
+}
+
+// _____________________________________________________________________________
+std::vector<size_t> largestShard(const std::vector<size_t>& offs) {
+  std::vector<std::vector<size_t>> shards(sj::GEOM_CACHE_SHARDS);
+  for (size_t off : offs) {
+    shards[sj::GeometryCache<sj::Point>::shardIndex(off)].push_back(off);
+  }
+
+  return *std::max_element(shards.begin(), shards.end(),
+                           [](const std::vector<size_t>& a,
+                              const std::vector<size_t>& b) {
+                             return a.size() < b.size();
+                           });
+}
+
+// _____________________________________________________________________________
+bool isHit(const sj::GeometryCache<sj::Point>& cache, size_t off,
+           ssize_t tid = 0) {
+  size_t hits = cache.hits().first;
+  cache.get(off, tid);
+  return cache.hits().first > hits;
+}
+
+// _____________________________________________________________________________
+sj::Job posJob(int32_t pos) {
+  sj::Job job;
+  job.pos = pos;
+  return job;
+}
+
 // _____________________________________________________________________________
 int main(int, char**) {
+  {
+    // a stolen chunk is older than the chunks its thief worked on before, it
+    // must still hold back the multis and the retired geometries
+    sj::JobScheduler<sj::Job, sj::JobCost, sj::JobPos> jobs(2, 1000000);
+
+    jobs.add({posJob(100)}, 1);
+    jobs.add({posJob(10)}, 0);
+    jobs.add({posJob(20)}, 0);
+    TEST(jobs.minPos(), ==, 10);
+
+    TEST(jobs.get(1).front().pos, ==, 100);
+    TEST(jobs.get(0).front().pos, ==, 10);
+    TEST(jobs.minPos(), ==, 10);
+
+    // worker 1 steals the chunk at 20 from worker 0
+    TEST(jobs.get(1).front().pos, ==, 20);
+    TEST(jobs.minPos(), ==, 10);
+
+    // worker 0 moves on, worker 1 is still at 20
+    jobs.add({posJob(200)}, 0);
+    TEST(jobs.get(0).front().pos, ==, 200);
+    TEST(jobs.minPos(), ==, 20);
+
+    // multi outputs hold back nothing
+    sj::Job multi;
+    multi.multiOut = "Amulti";
+    jobs.add({multi}, 0);
+    TEST(jobs.get(0).front().multiOut == "Amulti");
+    TEST(jobs.minPos(), ==, 20);
+
+    jobs.done();
+    TEST(jobs.get(1).empty());
+    TEST(jobs.get(0).empty());
+    TEST(jobs.minPos(), ==, std::numeric_limits<int32_t>::max());
+  }
+
+  {
+    // geometry caches in file mode, with 2560 elements each regular shard
+    // holds 30 points, and the S3-FIFO small queue 3
+    sj::GeometryCache<sj::Point> lru({false, false}, 0, 2560, sj::CACHE_LRU,
+                                     1, ".");
+    sj::GeometryCache<sj::Point> s3({false, false}, 0, 2560,
+                                    sj::CACHE_S3FIFO, 1, ".");
+    lru.MEM_STORE_MAX_SIZE = 0;
+    s3.MEM_STORE_MAX_SIZE = 0;
+
+    auto offs = addPoints(&lru, 40000, 0);
+    TEST(addPoints(&s3, 40000, 0) == offs);
+    lru.flush();
+    s3.flush();
+
+    // read through the mapped geometry file
+    for (size_t i = 0; i < 100; i++) {
+      TEST(lru.get(offs[i], 0)->id, ==, "p" + std::to_string(i));
+      TEST(lru.get(offs[i], 0)->subId, ==, i);
+    }
+
+    TEST(lru.hits().first, ==, 100);
+    TEST(lru.hits().second, ==, 100);
+
+    auto shard = largestShard({offs.begin() + 100, offs.end()});
+    TEST(shard.size() > 301);
+
+    size_t a = shard[0];
+
+    TEST(!isHit(lru, a));
+    TEST(isHit(lru, a));
+    TEST(!isHit(s3, a));
+    TEST(isHit(s3, a));
+
+    // a scan of one-off geometries
+    for (size_t i = 1; i <= 200; i++) {
+      TEST(!isHit(lru, shard[i]));
+      TEST(!isHit(s3, shard[i]));
+    }
+
+    // LRU lost the hot geometry, S3-FIFO promoted it to the main queue
+    TEST(!isHit(lru, a));
+    TEST(isHit(s3, a));
+
+    // a recently evicted geometry is in the ghost queue, and goes straight
+    // to the main queue when it comes back
+    TEST(!isHit(s3, shard[190]));
+    for (size_t i = 201; i <= 300; i++) TEST(!isHit(s3, shard[i]));
+    TEST(isHit(s3, shard[190]));
+    TEST(isHit(s3, a));
+
+    // evict from the main and the small queue
+    TEST(isHit(s3, shard[300]));
+    s3.evict(a);
+    s3.evict(shard[300]);
+    TEST(!isHit(s3, a));
+    TEST(!isHit(s3, shard[300]));
+
+    // prefetched geometries are cached, but not counted
+    auto hits = s3.hits();
+    s3.willNeed(shard[301]);
+    s3.prefetch(shard[301], false);
+    TEST(s3.hits() == hits);
+    TEST(isHit(s3, shard[301]));
+  }
+
+  {
+    // S3-FIFO size-aware admission: with 64000 bytes, each regular shard
+    // holds 750 bytes, its small queue 75
+    sj::GeometryCache<sj::Point> s3({false, false}, 64000, 0,
+                                    sj::CACHE_S3FIFO, 1, ".");
+    s3.MEM_STORE_MAX_SIZE = 0;
+
+    auto small = addPoints(&s3, 2, 0);
+    auto big = addPoints(&s3, 3, 200);
+    s3.flush();
+
+    // small geometries are admitted on their first request
+    TEST(!isHit(s3, small[0]));
+    TEST(isHit(s3, small[0]));
+
+    // large ones only on their second
+    TEST(!isHit(s3, big[0]));
+    TEST(!isHit(s3, big[0]));
+    TEST(isHit(s3, big[0]));
+
+    // ... except in the shard for large geometries
+    TEST(!isHit(s3, big[1], -1));
+    TEST(isHit(s3, big[1], -1));
+  }
+
   sj::SweeperCfg baseline{
       NUM_THREADS,  NUM_THREADS, 1000,        1000,       " intersects ",
       " contains ", " covers ",  " touches ", " equals ", " overlaps ",
@@ -133,9 +444,72 @@ int main(int, char**) {
       true,         false,       false,       -1,         false,
       {},           {},          {},          {},         {}};
 
-  std::vector<sj::SweeperCfg> cfgs{baseline,    all,         noSurfaceArea,
-                                   noBoxIds,    noObb,       noDiagBox,
-                                   noFastSweep, noInnerOuter};
+  sj::SweeperCfg stripes = all;
+  stripes.numSweepStripes = 3;
+
+  sj::SweeperCfg inMemorySort = all;
+  inMemorySort.sortMemBudget = 1000 * 1000 * 1000;
+
+  sj::SweeperCfg singleEvents = all;
+  singleEvents.singleEvents = true;
+
+  sj::SweeperCfg singleEventStripes = stripes;
+  singleEventStripes.singleEvents = true;
+
+  // spill the events in runs of a few events, which are merged
+  sj::SweeperCfg tinySort = all;
+  tinySort.sortMemBudget = 1;
+
+  sj::SweeperCfg tinySortStripes = stripes;
+  tinySortStripes.sortMemBudget = 1;
+
+  sj::SweeperCfg tinySortSingleEvents = singleEvents;
+  tinySortSingleEvents.sortMemBudget = 1;
+
+  // sweep the merged events while the later ones are still being merged
+  sj::SweeperCfg pipelined = tinySort;
+  pipelined.pipelineSweep = true;
+
+  sj::SweeperCfg pipelinedSingleEvents = tinySortSingleEvents;
+  pipelinedSingleEvents.pipelineSweep = true;
+
+  std::vector<sj::SweeperCfg> cfgs{baseline,
+                                   all,
+                                   noSurfaceArea,
+                                   noBoxIds,
+                                   noObb,
+                                   noDiagBox,
+                                   noFastSweep,
+                                   noInnerOuter,
+                                   stripes,
+                                   inMemorySort,
+                                   singleEvents,
+                                   singleEventStripes,
+                                   tinySort,
+                                   tinySortStripes,
+                                   tinySortSingleEvents,
+                                   pipelined,
+                                   pipelinedSingleEvents};
+
+  {
+    // the tiny budget spills the events in several runs, which are merged
+    RunStats stats, tinyStats;
+    auto res = fullRun(TEST_DATASET_DIR "/freiburg", all, &stats);
+    auto tinyRes =
+        fullRun(TEST_DATASET_DIR "/freiburg", tinySort, &tinyStats);
+
+    TEST(stats.numSortRuns, ==, 0);
+    TEST(tinyStats.numSortRuns > 2);
+    TEST(sortedLines(tinyRes) == sortedLines(res));
+
+    RunStats pipeStats;
+    auto pipeRes =
+        fullRun(TEST_DATASET_DIR "/freiburg", pipelined, &pipeStats);
+
+    TEST(pipeStats.numSortRuns > 2);
+    TEST(pipeStats.numReferences, ==, tinyStats.numReferences);
+    TEST(sortedLines(pipeRes) == sortedLines(res));
+  }
 
   for (auto cfg : cfgs) {
     {
@@ -900,4 +1274,234 @@ int main(int, char**) {
       TEST(std::regex_search(res, pattern4));
     }
   }
+
+  for (auto cfg : {all, singleEvents, stripes, tinySort, pipelined}) {
+    // joining a prepared dataset gives the same result as a direct join, the
+    // stored events are deduplicated
+    for (auto dataset : {TEST_DATASET_DIR "/freiburg",
+                         TEST_DATASET_DIR "/brandenburg"}) {
+      RunStats stats, prepStats;
+      auto res = fullRun(dataset, cfg, &stats);
+      auto prepRes = fullRun(dataset, cfg, &prepStats, ".prepTest");
+
+      TEST(prepStats.numReferences, ==, stats.numReferences);
+      TEST(sortedLines(prepRes) == sortedLines(res));
+    }
+  }
+
+  {
+    // equal points are only collapsed by their content hash, not during the
+    // sweep
+    std::ofstream dups(".hashDups");
+    dups << "p1\tPOINT(7.80 47.90)\n"
+            "p2\tPOINT(7.80 47.90)\n"
+            "p3\tPOINT(7.81 47.90)\n"
+            "l1\tLINESTRING(7.79 47.89,7.81 47.91)\n"
+            "l2\tLINESTRING(7.79 47.89,7.81 47.91)\n";
+
+    // horizontal lines stacked along y, crossed by a vertical line
+    std::ofstream tall(".tallLines");
+    for (size_t i = 0; i < 10; i++) {
+      tall << "h" << i << "\tLINESTRING(7.0 " << 47.0 + i * 0.1 << ",8.0 "
+           << 47.0 + i * 0.1 << ")\n";
+    }
+    tall << "v\tLINESTRING(7.5 46.9,7.5 48.0)\n";
+  }
+
+  auto hashDuplicates = [](sj::SweeperCfg* cfg) {
+    cfg->hashDuplicates = true;
+  };
+
+  // removing duplicates by their content hash doesn't change the result
+  for (const auto& stats :
+       compareRuns({all, singleEvents, stripes},
+                   {TEST_DATASET_DIR "/freiburg",
+                    TEST_DATASET_DIR "/brandenburg"},
+                   hashDuplicates)) {
+    TEST(stats.second.numReferences >= stats.first.numReferences);
+  }
+
+  for (const auto& stats :
+       compareRuns({all, singleEvents, stripes}, {".hashDups"},
+                   hashDuplicates)) {
+    TEST(stats.first.numReferences, ==, 0);
+    TEST(stats.second.numReferences, ==, 2);
+  }
+
+  // the sweep axis doesn't change the result
+  std::vector<sj::SweeperCfg> axisCfgs{all, singleEvents, stripes, noDiagBox};
+  std::vector<std::string> axisDatasets{
+      TEST_DATASET_DIR "/freiburg", TEST_DATASET_DIR "/brandenburg",
+      TEST_DATASET_DIR "/multitests", TEST_DATASET_DIR "/references",
+      ".tallLines"};
+
+  for (const auto& stats :
+       compareRuns(axisCfgs, axisDatasets, [](sj::SweeperCfg* cfg) {
+         cfg->sweepAxis = sj::SWEEP_Y;
+       })) {
+    TEST(!stats.first.transposed);
+    TEST(stats.second.transposed);
+  }
+
+  auto autoStats =
+      compareRuns(axisCfgs, axisDatasets,
+                  [](sj::SweeperCfg* cfg) { cfg->sweepAxis = sj::SWEEP_AUTO; });
+
+  // the stacked lines are swept along y
+  for (size_t i = 0; i < autoStats.size(); i++) {
+    if (axisDatasets[i % axisDatasets.size()] == ".tallLines") {
+      TEST(autoStats[i].second.transposed);
+    }
+  }
+
+  // several workers, which steal chunks from each other, give the same
+  // result, also for multi geometries
+  compareRuns({all, singleEvents, noDiagBox},
+              {TEST_DATASET_DIR "/freiburg", TEST_DATASET_DIR "/multitests",
+               TEST_DATASET_DIR "/collectiontests"},
+              [](sj::SweeperCfg* cfg) {
+                cfg->numThreads = 4;
+                cfg->numCacheThreads = 4;
+              });
+
+  // the cache eviction policy doesn't change the result
+  compareRuns({all, singleEvents},
+              {TEST_DATASET_DIR "/freiburg", TEST_DATASET_DIR "/brandenburg"},
+              [](sj::SweeperCfg* cfg) {
+                cfg->geomCachePolicy = sj::CACHE_S3FIFO;
+              });
+
+  // evicting the swept geometries doesn't change the result, with the
+  // geometries kept in the cache files
+  for (const auto& stats :
+       compareRuns({all, singleEvents, noDiagBox},
+                   {TEST_DATASET_DIR "/freiburg",
+                    TEST_DATASET_DIR "/brandenburg",
+                    TEST_DATASET_DIR "/multitests"},
+                   [](sj::SweeperCfg* cfg) {
+                     cfg->evictRetired = true;
+                     cfg->geomMemStoreMaxSize = 0;
+                   })) {
+    TEST(stats.first.numRetiredEvicted, ==, 0);
+    TEST(stats.second.numRetiredEvicted > 0);
+  }
+
+  // prefetching the geometries doesn't change the result
+  for (const auto& stats :
+       compareRuns({all, singleEvents, stripes},
+                   {TEST_DATASET_DIR "/freiburg",
+                    TEST_DATASET_DIR "/brandenburg",
+                    TEST_DATASET_DIR "/references"},
+                   [](sj::SweeperCfg* cfg) {
+                     cfg->prefetch = true;
+                     cfg->evictRetired = true;
+                     cfg->geomMemStoreMaxSize = 0;
+                   })) {
+    TEST(stats.second.numReferences, ==, stats.first.numReferences);
+  }
+
+  unlink(".hashDups");
+  unlink(".tallLines");
+
+  {
+    // delete grenzpunkt, move a and add neu to the freiburg dataset
+    std::ifstream ifs(TEST_DATASET_DIR "/freiburg");
+    std::ofstream changed(".freiburgChanged");
+    std::ofstream delta(".freiburgDelta");
+
+    std::string line;
+    while (std::getline(ifs, line)) {
+      if (line.compare(0, 11, "grenzpunkt\t") == 0) continue;
+      if (line.compare(0, 2, "a\t") == 0) continue;
+      changed << line << "\n";
+    }
+
+    std::string deltaLines =
+        "a\tPOINT(7.8373 47.9713)\n"
+        "neu\tLINESTRING(7.80 47.97,7.85 48.00)\n";
+    changed << deltaLines;
+    delta << deltaLines;
+  }
+
+  for (auto cfg : {all, singleEvents, noBoxIds}) {
+    // applying the delta to the full join of the old dataset gives the full
+    // join of the changed dataset
+    RunStats stats;
+    auto oldRes = sortedLines(fullRun(TEST_DATASET_DIR "/freiburg", cfg,
+                                      &stats));
+    auto newRes = sortedLines(fullRun(".freiburgChanged", cfg, &stats));
+
+    std::set<std::string> added, retracted;
+    deltaRun(TEST_DATASET_DIR "/freiburg", ".freiburgDelta", {"grenzpunkt"},
+             cfg, &added, &retracted);
+
+    TEST(retracted.size() > 0);
+    TEST(added.size() > 0);
+
+    std::set<std::string> res;
+    for (const auto& rel : oldRes) {
+      if (!retracted.count(rel)) res.insert(rel);
+    }
+    res.insert(added.begin(), added.end());
+
+    TEST(res == std::set<std::string>(newRes.begin(), newRes.end()));
+  }
+
+  unlink(".freiburgChanged");
+  unlink(".freiburgDelta");
+
+  {
+    // the first polygon and the first line both have the cache offset 0, the
+    // duplicate lines must not be taken for references of the polygon
+    std::ofstream dups(".dupOffsets");
+    dups << "P1\tPOLYGON((0 0, 100 0, 100 100, 0 100, 0 0), (40 40, 60 40, "
+            "60 60, 40 60, 40 40))\n"
+         << "P2\tPOLYGON((0 0, 100 0, 100 100, 0 100, 0 0), (40 40, 60 40, "
+            "60 60, 40 60, 40 40))\n"
+         << "L1\tLINESTRING(10 10, 15 12, 20 20)\n"
+         << "L2\tLINESTRING(10 10, 15 12, 20 20)\n";
+  }
+
+  for (auto cfg : {all, singleEvents, stripes, tinySort}) {
+    RunStats stats;
+    auto res = fullRun(".dupOffsets", cfg, &stats);
+
+    TEST(stats.numReferences, ==, 2);
+    TEST(res.find("$P1 equals P2$") != std::string::npos);
+    TEST(res.find("$P2 equals P1$") != std::string::npos);
+    TEST(res.find("$L1 equals L2$") != std::string::npos);
+    TEST(res.find("$L2 equals L1$") != std::string::npos);
+  }
+
+  unlink(".dupOffsets");
+
+  {
+    // the areas of O and I, and the lengths of L and S and of M and N,
+    // differ by less than the precision of the event keys, and each pair
+    // leaves the sweep at the same x. The larger geometries come first and
+    // thus leave first.
+    std::ofstream nested(".nearlyEqual");
+    nested << "O\tPOLYGON((0 0, 1 0, 1 1, 0 1, 0 0))\n"
+           << "I\tPOLYGON((0 0, 1 0, 1 1, 0 1, 0.000001 0.5, 0 0))\n"
+           << "L\tLINESTRING(0 0, 5 0, 5 5)\n"
+           << "S\tLINESTRING(0.000001 0, 5 0, 5 5)\n"
+           << "M\tLINESTRING(0 0, 10 0)\n"
+           << "N\tLINESTRING(0.000001 0, 10 0)\n";
+  }
+
+  for (auto cfg : {all, inMemorySort, singleEvents, stripes, tinySort}) {
+    RunStats stats;
+    auto res = fullRun(".nearlyEqual", cfg, &stats);
+
+    TEST(res.find("$O contains I$") != std::string::npos);
+    TEST(res.find("$O covers I$") != std::string::npos);
+    TEST(res.find("$I contains O$") == std::string::npos);
+    TEST(res.find("$O equals I$") == std::string::npos);
+    TEST(res.find("$L covers S$") != std::string::npos);
+    TEST(res.find("$S covers L$") == std::string::npos);
+    TEST(res.find("$M covers N$") != std::string::npos);
+    TEST(res.find("$N covers M$") == std::string::npos);
+  }
+
+  unlink(".nearlyEqual");
 }